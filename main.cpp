@@ -1,7 +1,14 @@
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <thread>
 #include <vector>
 
 #define UTF_CPP_CPLUSPLUS 199711L
@@ -17,8 +24,14 @@ const std::vector<uint16_t> invalid_utf16_surrogate = { 0xdc00, 0xd800 };
 const std::vector<uint16_t> incomplete_utf16_surrogate = { 0xd800 };
 const std::vector<uint16_t> valid_utf16_surrogate = { 0xd800, 0xdc00 };
 
-static std::vector<uint16_t> utf8_to_utf16_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
-  std::vector<uint16_t> res;
+// Vector whose storage, like that of any temporaries, comes from a copy of the given allocator
+template <typename T, typename allocator_type>
+using rebound_vector = std::vector<T, typename std::allocator_traits<allocator_type>::template rebind_alloc<T>>;
+
+template <typename allocator_type = std::allocator<uint16_t>>
+static rebound_vector<uint16_t, allocator_type> utf8_to_utf16_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char,
+    const allocator_type &alloc = allocator_type()) {
+  rebound_vector<uint16_t, allocator_type> res(alloc);
   std::back_insert_iterator res_bi = std::back_inserter(res);
 
   const uint8_t *in_buf_end = in_buf + in_buf_len;
@@ -30,7 +43,7 @@ static std::vector<uint16_t> utf8_to_utf16_lenient(const uint8_t *in_buf, size_t
       *first_invalid_char = nullptr;
     }
   } else {
-    std::vector<uint8_t> replaced;
+    rebound_vector<uint8_t, allocator_type> replaced(alloc);
     std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
     utf8::replace_invalid(in_buf, in_buf_end, replaced_bi, invalid_char_replacement);
     utf8::unchecked::utf8to16(replaced.begin(), replaced.end(), res_bi);
@@ -90,8 +103,10 @@ output_iterator utf16_replace_invalid(u16bit_iterator start, u16bit_iterator end
   return out;
 }
 
-static std::vector<uint8_t> utf16_to_utf8_lenient(const uint16_t *in_buf, size_t in_buf_len, const uint16_t** first_invalid_char) {
-  std::vector<uint8_t> res;
+template <typename allocator_type = std::allocator<uint8_t>>
+static rebound_vector<uint8_t, allocator_type> utf16_to_utf8_lenient(const uint16_t *in_buf, size_t in_buf_len, const uint16_t** first_invalid_char,
+    const allocator_type &alloc = allocator_type()) {
+  rebound_vector<uint8_t, allocator_type> res(alloc);
   std::back_insert_iterator res_bi = std::back_inserter(res);
 
   const uint16_t *in_buf_end = in_buf + in_buf_len;
@@ -103,7 +118,7 @@ static std::vector<uint8_t> utf16_to_utf8_lenient(const uint16_t *in_buf, size_t
       *first_invalid_char = nullptr;
     }
   } else {
-    std::vector<uint16_t> replaced;
+    rebound_vector<uint16_t, allocator_type> replaced(alloc);
     std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
     utf16_replace_invalid(in_buf, in_buf_end, replaced_bi, invalid_char_replacement);
     utf8::unchecked::utf16to8(replaced.begin(), replaced.end(), res_bi);
@@ -115,272 +130,2670 @@ static std::vector<uint8_t> utf16_to_utf8_lenient(const uint16_t *in_buf, size_t
   return res;
 }
 
-static void assert(bool check, const std::string &label) {
-  if (!check) {
-    std::cerr << "Assertion failed: " << label << std::endl;
-    std::exit(1);
+// Decodes a single code point with the same recovery rules as utf8::replace_invalid:
+// an invalid lead octet and its trailing continuation octets yield one replacement
+static utf8::internal::utf_error utf8_next_lenient(const uint8_t *&it, const uint8_t *end, uint32_t &cp) {
+  utf8::internal::utf_error err = utf8::internal::validate_next(it, end, cp);
+  switch (err) {
+    case utf8::internal::UTF8_OK:
+      break;
+    case utf8::internal::NOT_ENOUGH_ROOM:
+      cp = invalid_char_replacement;
+      it = end;
+      break;
+    case utf8::internal::INVALID_LEAD:
+      cp = invalid_char_replacement;
+      ++it;
+      break;
+    default:
+      cp = invalid_char_replacement;
+      ++it;
+      while (it != end && utf8::internal::is_trail(*it)) {
+        ++it;
+      }
+      break;
   }
+  return err;
 }
 
-static void test_utf8_to_utf16() {
-  {
-    auto res = utf8_to_utf16_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), nullptr);
-    assert(res == hello_bg_utf16, "hello_bg_utf8 1");
+static size_t utf8_decode_block_lenient(const uint8_t **in_buf, const uint8_t *in_buf_end, uint32_t *out_buf, size_t out_buf_len, const uint8_t** first_invalid_char) {
+  const uint8_t *it = *in_buf;
+  size_t count = 0;
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = nullptr;
   }
-  {
-    const uint8_t val = 42;
-    const uint8_t *ptr = &val;
-    auto res = utf8_to_utf16_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr);
-    assert(res == hello_bg_utf16, "hello_bg_utf8 2 1");
-    assert(ptr == nullptr, "hello_bg_utf8 2 2");
+
+  while (count < out_buf_len && it != in_buf_end) {
+    count += utf8::internal::decode_ascii(it, in_buf_end, out_buf + count, out_buf_len - count);
+    if (count == out_buf_len || it == in_buf_end) {
+      break;
+    }
+    const uint8_t *sequence_start = it;
+    utf8::internal::utf_error err = utf8_next_lenient(it, in_buf_end, out_buf[count++]);
+    if (err != utf8::internal::UTF8_OK && nullptr != first_invalid_char && nullptr == *first_invalid_char) {
+      *first_invalid_char = sequence_start;
+    }
   }
-  {
-    const uint8_t *ptr = nullptr;
-    auto res = utf8_to_utf16_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), &ptr);
-    assert(ptr != nullptr, "invalid_utf8_continuation 1");
-    assert(ptr - invalid_utf8_continuation.data() == 1, "invalid_utf8_continuation 2");
+
+  *in_buf = it;
+  return count;
+}
+
+// Decodes UTF-16 with the recovery rules of utf16_to_utf8_lenient without building the replaced
+// buffer: units are read as utf16_replace_invalid writes them and decoded the way
+// utf8::unchecked::utf16to8 decodes that buffer. A lone trail surrogate at the end of otherwise
+// valid input is kept, as utf16_find_invalid does not report it
+class utf16_lenient_reader {
+  const uint16_t *it;
+  const uint16_t *end;
+  bool copy_next = false; // utf16_replace_invalid copies the unit at it as it is
+  size_t replacements = 0;
+
+  uint16_t next_unit() {
+    const uint16_t unit = *it++;
+    if (copy_next) {
+      copy_next = false;
+    } else if (utf8::internal::is_lead_surrogate(unit)) {
+      if (it == end) {
+        replacements += 1;
+        return static_cast<uint16_t>(invalid_char_replacement);
+      }
+      copy_next = true;
+      if (!utf8::internal::is_trail_surrogate(*it)) {
+        replacements += 1;
+        return static_cast<uint16_t>(invalid_char_replacement);
+      }
+    } else if (utf8::internal::is_trail_surrogate(unit) && (it != end || replacements > 0)) {
+      replacements += 1;
+      return static_cast<uint16_t>(invalid_char_replacement);
+    }
+    return unit;
   }
-  {
-    const uint8_t *ptr = nullptr;
-    auto res = utf8_to_utf16_lenient(incomplete_utf8_sequence.data(), incomplete_utf8_sequence.size(), &ptr);
-    assert(ptr != nullptr, "incomplete_utf8_sequence 1");
-    assert(ptr - incomplete_utf8_sequence.data() == 0, "incomplete_utf8_sequence 2");
+
+ public:
+  utf16_lenient_reader(const uint16_t *begin, const uint16_t *end) : it(begin), end(end) {}
+
+  const uint16_t *position() const { return it; }
+  bool done() const { return it == end; }
+
+  // Returns false when the last unit is a copied lead surrogate, which utf16to8 drops;
+  // invalid is set when the code point includes a replacement
+  bool next(uint32_t &cp, bool &invalid) {
+    const size_t replaced_before = replacements;
+    cp = next_unit();
+    if (utf8::internal::is_lead_surrogate(cp)) {
+      if (it == end) {
+        invalid = false;
+        return false;
+      }
+      cp = (cp << 10) + next_unit() + utf8::internal::SURROGATE_OFFSET;
+    }
+    invalid = replacements != replaced_before;
+    return true;
   }
-  {
-    const uint8_t *ptr = nullptr;
-    auto res = utf8_to_utf16_lenient(invalid_overlong_utf8.data(), invalid_overlong_utf8.size(), &ptr);
-    assert(ptr != nullptr, "invalid_overlong_utf8 1");
-    assert(ptr - invalid_overlong_utf8.data() == 0, "invalid_overlong_utf8 2");
+};
+
+template <typename u32bit_iterator>
+u32bit_iterator utf32_find_invalid(u32bit_iterator start, u32bit_iterator end) {
+  // Whole blocks are checked without early exits, so that the compiler can vectorize the loop
+  while (end - start >= 16) {
+    bool invalid = false;
+    for (int i = 0; i < 16; i++) {
+      const uint32_t cp = start[i];
+      invalid |= (cp - utf8::internal::LEAD_SURROGATE_MIN < 0x800u) | (cp > utf8::internal::CODE_POINT_MAX);
+    }
+    if (invalid) {
+      break;
+    }
+    start += 16;
   }
-  {
-    const uint8_t *ptr = nullptr;
-    std::vector<uint8_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
-    std::copy(invalid_utf8_continuation.begin(), invalid_utf8_continuation.end(), in_buf_bi);
-    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
-    auto res = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
-    assert(ptr != nullptr, "hello invalid_utf8_continuation 1");
-    assert((ptr - in_buf.data()) == 19, "hello invalid_utf8_continuation 2");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin()), "hello invalid_utf8_continuation 3");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin() + 12), "hello invalid_utf8_continuation 4");
-    assert(res[hello_bg_utf16.size()] == 0x48, "hello invalid_utf8_continuation 5");
-    assert(res[hello_bg_utf16.size() + 1] == invalid_char_replacement, "hello invalid_utf8_continuation 6");
-    assert(res[hello_bg_utf16.size() + 2] == 0x65, "hello invalid_utf8_continuation 7");
+  while (start != end && utf8::internal::is_code_point_valid(*start)) {
+    ++start;
   }
-  {
-    const uint8_t *ptr = nullptr;
-    std::vector<uint8_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
-    std::copy(incomplete_utf8_sequence.begin(), incomplete_utf8_sequence.end(), in_buf_bi);
-    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
-    auto res = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
-    assert(ptr != nullptr, "hello incomplete_utf8_sequence 1");
-    assert((ptr - in_buf.data()) == 18, "hello incomplete_utf8_sequence 2");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin()), "hello incomplete_utf8_sequence 3");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin() + 10), "hello incomplete_utf8_sequence 4");
-    assert(res[hello_bg_utf16.size()] == invalid_char_replacement, "hello incomplete_utf8_sequence 5");
+  return start;
+}
+
+template <typename u32bit_iterator, typename output_iterator>
+output_iterator utf32_replace_invalid(u32bit_iterator start, u32bit_iterator end, output_iterator out, utf8::utfchar32_t replacement) {
+  while (start != end) {
+    const uint32_t cp = *start++;
+    *out++ = utf8::internal::is_code_point_valid(cp) ? cp : replacement;
   }
-  {
-    const uint8_t *ptr = nullptr;
-    std::vector<uint8_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
-    std::copy(invalid_overlong_utf8.begin(), invalid_overlong_utf8.end(), in_buf_bi);
-    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
-    auto res = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
-    assert(ptr != nullptr, "hello invalid_overlong_utf8 1");
-    assert((ptr - in_buf.data()) == 18, "hello invalid_overlong_utf8 2");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin()), "hello invalid_overlong_utf8 3");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin() + 10), "hello invalid_overlong_utf8 4");
-    assert(res[hello_bg_utf16.size()] == invalid_char_replacement, "hello invalid_overlong_utf8 5");
+  return out;
+}
+
+// Number of octets needed for the code point, or for its replacement
+static size_t utf32_utf8_length(uint32_t cp) {
+  if (cp > utf8::internal::CODE_POINT_MAX) {
+    return 3;
   }
+  return 1 + (cp >= 0x80) + (cp >= 0x800) + (cp >= 0x10000);
 }
 
-void test_utf16_find_invalid() {
-  {
-    auto res = utf16_find_invalid(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end()); 
-    assert(res != invalid_utf16_surrogate.end(), "find invalid_utf16_surrogate 1");
+static std::vector<uint8_t> utf32_to_utf8_lenient(const uint32_t *in_buf, size_t in_buf_len, const uint32_t** first_invalid_char) {
+  const uint32_t *in_buf_end = in_buf + in_buf_len;
+  const uint32_t *fic = utf32_find_invalid(in_buf, in_buf_end);
+
+  size_t res_len = 0;
+  for (const uint32_t *it = in_buf; it != in_buf_end; ++it) {
+    res_len += utf32_utf8_length(*it);
   }
-  {
-    auto res = utf16_find_invalid(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end()); 
-    assert(res != incomplete_utf16_surrogate.end(), "find incomplete_utf16_surrogate 1");
+  std::vector<uint8_t> res(res_len);
+  uint8_t *out = res.data();
+
+  if (fic == in_buf_end) {
+    utf8::unchecked::utf32to8(in_buf, in_buf_end, out);
+    if (nullptr != first_invalid_char) {
+      *first_invalid_char = nullptr;
+    }
+  } else {
+    out = utf8::unchecked::utf32to8(in_buf, fic, out);
+    for (const uint32_t *it = fic; it != in_buf_end; ++it) {
+      out = utf8::unchecked::append(utf8::internal::is_code_point_valid(*it) ? *it : invalid_char_replacement, out);
+    }
+    if (nullptr != first_invalid_char) {
+      *first_invalid_char = fic;
+    }
   }
-  {
-    auto res = utf16_find_invalid(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end());
-    assert(res == valid_utf16_surrogate.end(), "find valid_utf16_surrogate 1");
+
+  return res;
+}
+
+static std::vector<uint32_t> utf8_to_utf32_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+
+  // Counting pass: the exact output length, each invalid sequence yields one replacement
+  const uint8_t *fic = nullptr;
+  size_t res_len = 0;
+  for (const uint8_t *it = in_buf; it != in_buf_end; ) {
+    const uint8_t *invalid = utf8::find_invalid(it, in_buf_end);
+    res_len += utf8::internal::count_lead_octets(it, invalid);
+    if (invalid == in_buf_end) {
+      break;
+    }
+    if (nullptr == fic) {
+      fic = invalid;
+    }
+    uint32_t cp = 0;
+    it = invalid;
+    utf8_next_lenient(it, in_buf_end, cp);
+    res_len += 1;
   }
-  {
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    auto res = utf16_find_invalid(in_buf.begin(), in_buf.end());
-    assert((res - in_buf.begin()) == hello_bg_utf16.size() + 1, "find hello invalid_utf16_surrogate 1");
+
+  // Decoding pass: valid spans after the first invalid sequence are located again and decoded without checks
+  std::vector<uint32_t> res(res_len);
+  uint32_t *out = res.data();
+  for (const uint8_t *it = in_buf; it != in_buf_end; ) {
+    const uint8_t *invalid = (nullptr == fic) ? in_buf_end : (it <= fic) ? fic : utf8::find_invalid(it, in_buf_end);
+    out = utf8::unchecked::utf8to32(it, invalid, out);
+    it = invalid;
+    if (it != in_buf_end) {
+      utf8_next_lenient(it, in_buf_end, *out++);
+    }
   }
-  {
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    auto res = utf16_find_invalid(in_buf.begin(), in_buf.end());
-    assert((res - in_buf.begin()) == hello_bg_utf16.size() + 1, "find hello incomplete_utf16_surrogate 1");
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
   }
-  {
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    auto res = utf16_find_invalid(in_buf.begin(), in_buf.end());
-    assert(res == in_buf.end(), "find hello valid_utf16_surrogate 1");
+  return res;
+}
+
+static std::vector<uint16_t> utf32_to_utf16_lenient(const uint32_t *in_buf, size_t in_buf_len, const uint32_t** first_invalid_char) {
+  const uint32_t *in_buf_end = in_buf + in_buf_len;
+  const uint32_t *fic = utf32_find_invalid(in_buf, in_buf_end);
+
+  size_t res_len = in_buf_len;
+  for (const uint32_t *it = in_buf; it != in_buf_end; ++it) {
+    res_len += (*it >= 0x10000 && *it <= utf8::internal::CODE_POINT_MAX);
+  }
+  std::vector<uint16_t> res(res_len);
+  uint16_t *out = res.data();
+  for (const uint32_t *it = in_buf; it != in_buf_end; ++it) {
+    out = utf8::unchecked::append16(utf8::internal::is_code_point_valid(*it) ? *it : invalid_char_replacement, out);
+  }
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = (fic == in_buf_end) ? nullptr : fic;
   }
+  return res;
 }
 
-static void test_utf16_replace_invalid() {
-  {
-    std::vector<uint16_t> replaced;
-    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
-    utf16_replace_invalid(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), replaced_bi, invalid_char_replacement);
-    assert(replaced.size() == 2, "replace invalid_utf16_surrogate 1");
-    assert(replaced[0] == invalid_char_replacement, "replace invalid_utf16_surrogate 2");
-    assert(replaced[1] == invalid_char_replacement, "replace invalid_utf16_surrogate 3");
+static std::vector<uint32_t> utf16_to_utf32_lenient(const uint16_t *in_buf, size_t in_buf_len, const uint16_t** first_invalid_char) {
+  const uint16_t *in_buf_end = in_buf + in_buf_len;
+  const uint16_t *fic = utf16_find_invalid(in_buf, in_buf_end);
+
+  uint32_t cp = 0;
+  bool invalid = false;
+  size_t res_len = 0;
+  for (utf16_lenient_reader reader(in_buf, in_buf_end); !reader.done(); ) {
+    res_len += reader.next(cp, invalid);
   }
-  {
-    std::vector<uint16_t> replaced;
-    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
-    utf16_replace_invalid(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), replaced_bi, invalid_char_replacement);
-    assert(replaced.size() == 1, "replace incomplete_utf16_surrogate 1");
-    assert(replaced[0] == invalid_char_replacement, "replace incomplete_utf16_surrogate 2");
+  std::vector<uint32_t> res(res_len);
+  uint32_t *out = res.data();
+  for (utf16_lenient_reader reader(in_buf, in_buf_end); !reader.done(); ) {
+    if (reader.next(cp, invalid)) {
+      *out++ = cp;
+    }
   }
-  {
-    std::vector<uint16_t> replaced;
-    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
-    utf16_replace_invalid(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), replaced_bi, invalid_char_replacement);
-    assert(replaced == valid_utf16_surrogate, "replace valid_utf16_surrogate 1");
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = (fic == in_buf_end) ? nullptr : fic;
   }
-  {
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::vector<uint16_t> replaced;
-    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
-    utf16_replace_invalid(in_buf.begin(), in_buf.end(), replaced_bi, invalid_char_replacement);
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin()), "replace hello invalid_utf16_surrogate 1");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin() + 11), "replace hello invalid_utf16_surrogate 2");
-    assert(replaced[9] == invalid_char_replacement, "replace hello invalid_utf16_surrogate 3");
-    assert(replaced[10] == invalid_char_replacement, "replace hello invalid_utf16_surrogate 4");
+  return res;
+}
+
+// Latin-1 when every code point fits in an octet, UTF-16 otherwise; only the chosen vector is filled
+struct compact_string {
+  bool latin1;
+  std::vector<uint8_t> latin1_chars;
+  std::vector<uint16_t> utf16_chars;
+};
+
+static compact_string utf8_to_compact_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  const uint8_t *fic = nullptr;
+  uint32_t max_cp = 0;
+  size_t utf16_len = 0;
+
+  // Pre-scan for the widest code point and the length, replacements count as U+FFFD
+  const uint8_t *it = in_buf;
+  while (it != in_buf_end) {
+    const uint8_t *ascii_end = utf8::internal::skip_ascii(it, in_buf_end);
+    utf16_len += ascii_end - it;
+    it = ascii_end;
+    if (it == in_buf_end) {
+      break;
+    }
+    const uint8_t *sequence_start = it;
+    uint32_t cp = 0;
+    if (utf8_next_lenient(it, in_buf_end, cp) != utf8::internal::UTF8_OK && nullptr == fic) {
+      fic = sequence_start;
+    }
+    max_cp = std::max(max_cp, cp);
+    utf16_len += utf8::internal::is_in_bmp(cp) ? 1 : 2;
   }
-  {
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::vector<uint16_t> replaced;
-    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
-    utf16_replace_invalid(in_buf.begin(), in_buf.end(), replaced_bi, invalid_char_replacement);
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin()), "replace hello incomplete_utf16_surrogate 1");
-    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin() + 10), "replace hello incomplete_utf16_surrogate 2");
-    assert(replaced[9] == invalid_char_replacement, "replace hello incomplete_utf16_surrogate 3");
+
+  compact_string res;
+  res.latin1 = max_cp <= 0xff;
+  it = in_buf;
+  if (res.latin1) {
+    // Only ASCII and valid two-octet sequences are left, the length is the number of code points
+    res.latin1_chars.resize(utf16_len);
+    uint8_t *out = res.latin1_chars.data();
+    while (it != in_buf_end) {
+      out += utf8::internal::decode_ascii(it, in_buf_end, out, res.latin1_chars.size() - (out - res.latin1_chars.data()));
+      if (it != in_buf_end) {
+        *out++ = static_cast<uint8_t>(utf8::unchecked::next(it));
+      }
+    }
+  } else {
+    res.utf16_chars.resize(utf16_len);
+    uint16_t *out = res.utf16_chars.data();
+    while (it != in_buf_end) {
+      out += utf8::internal::decode_ascii(it, in_buf_end, out, res.utf16_chars.size() - (out - res.utf16_chars.data()));
+      if (it != in_buf_end) {
+        uint32_t cp = 0;
+        utf8_next_lenient(it, in_buf_end, cp);
+        out = utf8::unchecked::append16(cp, out);
+      }
+    }
   }
-  {
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::vector<uint16_t> replaced;
-    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
-    utf16_replace_invalid(in_buf.begin(), in_buf.end(), replaced_bi, invalid_char_replacement);
-    assert(replaced == in_buf, "replace hello valid_utf16_surrogate 1");
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
   }
+  return res;
 }
 
-static void test_utf16_to_utf8() {
-  {
-    auto res = utf16_to_utf8_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), nullptr);
-    assert(res == hello_bg_utf8, "hello_bg_utf16 1");
+static std::vector<uint8_t> latin1_to_utf8(const uint8_t *in_buf, size_t in_buf_len) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  size_t high_octets = 0;
+  const uint8_t *it = in_buf;
+  for (; utf8::internal::has_full_word(it, in_buf_end); it += sizeof(size_t)) {
+    high_octets += utf8::internal::count_flagged_octets(utf8::internal::load_word(it) & utf8::internal::WORD_HIGH_BITS);
   }
-  {
-    const uint16_t val = 42;
-    const uint16_t *ptr = &val;
-    auto res = utf16_to_utf8_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), &ptr);
-    assert(res == hello_bg_utf8, "hello_bg_utf16 2 1");
-    assert(ptr == nullptr, "hello_bg_utf16 2 2");
+  for (; it != in_buf_end; ++it) {
+    high_octets += *it >> 7;
   }
-  {
-    const uint16_t *ptr = nullptr;
-    auto res = utf16_to_utf8_lenient(invalid_utf16_surrogate.data(), invalid_utf16_surrogate.size(), &ptr);
-    assert(ptr != nullptr, "invalid_utf16_surrogate 1");
-    assert(ptr - invalid_utf16_surrogate.data() == 1, "invalid_utf16_surrogate 2");
+
+  std::vector<uint8_t> res(in_buf_len + high_octets);
+  uint8_t *out = res.data();
+  it = in_buf;
+  while (it != in_buf_end) {
+    const uint8_t *ascii_end = utf8::internal::skip_ascii(it, in_buf_end);
+    out = std::copy(it, ascii_end, out);
+    for (it = ascii_end; it != in_buf_end && *it >= 0x80; ++it) {
+      *out++ = static_cast<uint8_t>(0xc0 | (*it >> 6));
+      *out++ = static_cast<uint8_t>(0x80 | (*it & 0x3f));
+    }
   }
-  {
+  return res;
+}
+
+// True when no octet in the word is a control character, a quote, a backslash or non-ASCII
+static bool is_json_clean_word(size_t word) {
+  const size_t ones = utf8::internal::WORD_ONES;
+  const size_t quote = word ^ (ones * '"');
+  const size_t backslash = word ^ (ones * '\\');
+  const size_t flagged = word | ((word - ones * 0x20) & ~word) | ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash);
+  return !(flagged & utf8::internal::WORD_HIGH_BITS);
+}
+
+static void append_json_unit(uint32_t unit, std::vector<uint8_t> &out) {
+  static const char hex_digits[] = "0123456789abcdef";
+  out.push_back('\\');
+  out.push_back('u');
+  for (int shift = 12; shift >= 0; shift -= 4) {
+    out.push_back(hex_digits[(unit >> shift) & 0xf]);
+  }
+}
+
+// Escapes UTF-8 for the inside of a JSON string literal, without the enclosing quotes,
+// invalid sequences are replaced in the same pass. With escape_non_ascii the output is pure ASCII.
+static std::vector<uint8_t> utf8_to_json_lenient(const uint8_t *in_buf, size_t in_buf_len, bool escape_non_ascii, const uint8_t** first_invalid_char) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  const uint8_t *fic = nullptr;
+  std::vector<uint8_t> res;
+  res.reserve(in_buf_len + in_buf_len / 8);
+
+  const uint8_t *it = in_buf;
+  while (it != in_buf_end) {
+    if (utf8::internal::has_full_word(it, in_buf_end) && is_json_clean_word(utf8::internal::load_word(it))) {
+      res.insert(res.end(), it, it + sizeof(size_t));
+      it += sizeof(size_t);
+      continue;
+    }
+    const uint8_t octet = *it;
+    if (octet < 0x80) {
+      ++it;
+      switch (octet) {
+        case '"': res.push_back('\\'); res.push_back('"'); break;
+        case '\\': res.push_back('\\'); res.push_back('\\'); break;
+        case '\b': res.push_back('\\'); res.push_back('b'); break;
+        case '\f': res.push_back('\\'); res.push_back('f'); break;
+        case '\n': res.push_back('\\'); res.push_back('n'); break;
+        case '\r': res.push_back('\\'); res.push_back('r'); break;
+        case '\t': res.push_back('\\'); res.push_back('t'); break;
+        default:
+          if (octet < 0x20) {
+            append_json_unit(octet, res);
+          } else {
+            res.push_back(octet);
+          }
+          break;
+      }
+      continue;
+    }
+
+    const uint8_t *sequence_start = it;
+    uint32_t cp = 0;
+    utf8::internal::utf_error err = utf8_next_lenient(it, in_buf_end, cp);
+    if (err != utf8::internal::UTF8_OK && nullptr == fic) {
+      fic = sequence_start;
+    }
+    if (escape_non_ascii) {
+      if (utf8::internal::is_in_bmp(cp)) {
+        append_json_unit(cp, res);
+      } else {
+        append_json_unit(utf8::internal::LEAD_OFFSET + (cp >> 10), res);
+        append_json_unit(utf8::internal::TRAIL_SURROGATE_MIN + (cp & 0x3ff), res);
+      }
+    } else if (err == utf8::internal::UTF8_OK) {
+      res.insert(res.end(), sequence_start, it);
+    } else {
+      utf8::unchecked::append(cp, std::back_inserter(res));
+    }
+  }
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
+  }
+  return res;
+}
+
+static int hex_digit_value(uint8_t octet) {
+  if (octet >= '0' && octet <= '9') {
+    return octet - '0';
+  }
+  octet |= 0x20;
+  if (octet >= 'a' && octet <= 'f') {
+    return octet - 'a' + 10;
+  }
+  return -1;
+}
+
+// Decodes one octet of a URL component, a '%' that does not start a valid escape is taken literally
+static uint8_t percent_decode_next(const uint8_t *&it, const uint8_t *end) {
+  if ('%' == *it && end - it >= 3) {
+    const int high = hex_digit_value(it[1]);
+    const int low = hex_digit_value(it[2]);
+    if (high >= 0 && low >= 0) {
+      it += 3;
+      return static_cast<uint8_t>((high << 4) | low);
+    }
+  }
+  return *it++;
+}
+
+// Un-escapes %XX sequences and validates the decoded octets as UTF-8 in the same pass, keeping at most
+// one sequence of decoded octets in flight. first_invalid_char points into the encoded input. Without
+// replace_invalid the decoded octets of invalid sequences are copied unchanged.
+static std::vector<uint8_t> percent_decode_lenient(const uint8_t *in_buf, size_t in_buf_len, bool replace_invalid, const uint8_t** first_invalid_char) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  const uint8_t *fic = nullptr;
+  std::vector<uint8_t> res;
+  res.reserve(in_buf_len);
+
+  uint8_t window[4];
+  const uint8_t *window_pos[4];
+  size_t window_len = 0;
+  const uint8_t *it = in_buf;
+  auto fill = [&]() {
+    while (window_len < 4 && it != in_buf_end) {
+      window_pos[window_len] = it;
+      window[window_len++] = percent_decode_next(it, in_buf_end);
+    }
+  };
+  auto drop = [&](size_t count, bool copy) {
+    if (copy) {
+      res.insert(res.end(), window, window + count);
+    }
+    std::copy(window + count, window + window_len, window);
+    std::copy(window_pos + count, window_pos + window_len, window_pos);
+    window_len -= count;
+  };
+
+  while (true) {
+    // Spans without escapes or non-ASCII octets are copied a word at a time
+    const size_t escape_ones = utf8::internal::WORD_ONES * '%';
+    while (0 == window_len && utf8::internal::has_full_word(it, in_buf_end)) {
+      const size_t word = utf8::internal::load_word(it);
+      const size_t escapes = word ^ escape_ones;
+      if ((word | ((escapes - utf8::internal::WORD_ONES) & ~escapes)) & utf8::internal::WORD_HIGH_BITS) {
+        break;
+      }
+      res.insert(res.end(), it, it + sizeof(size_t));
+      it += sizeof(size_t);
+    }
+    fill();
+    if (0 == window_len) {
+      break;
+    }
+
+    uint8_t *window_it = window;
+    switch (utf8::internal::validate_next(window_it, window + window_len)) {
+      case utf8::internal::UTF8_OK:
+        drop(window_it - window, true);
+        continue;
+      case utf8::internal::NOT_ENOUGH_ROOM:
+        // Only possible at the end of the input, the window holds the rest of it
+        if (nullptr == fic) {
+          fic = window_pos[0];
+        }
+        drop(window_len, !replace_invalid);
+        break;
+      case utf8::internal::INVALID_LEAD:
+        if (nullptr == fic) {
+          fic = window_pos[0];
+        }
+        drop(1, !replace_invalid);
+        break;
+      default:
+        if (nullptr == fic) {
+          fic = window_pos[0];
+        }
+        drop(1, !replace_invalid);
+        for (fill(); window_len > 0 && utf8::internal::is_trail(window[0]); fill()) {
+          drop(1, !replace_invalid);
+        }
+        break;
+    }
+    if (replace_invalid) {
+      utf8::unchecked::append(invalid_char_replacement, std::back_inserter(res));
+    }
+  }
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
+  }
+  return res;
+}
+
+// Block decoders with the recovery rules of the lenient converters, used to compare and hash
+// strings by code point regardless of their encoding
+// Input position of the block decoders; UTF-16 input keeps the reader state between blocks
+template <typename unit>
+struct lenient_cursor {
+  lenient_cursor(const unit *begin, const unit *end) : it(begin), end(end) {}
+  const unit *it;
+  const unit *end;
+};
+
+template <>
+struct lenient_cursor<uint16_t> : utf16_lenient_reader {
+  using utf16_lenient_reader::utf16_lenient_reader;
+};
+
+static size_t decode_block_lenient(lenient_cursor<uint8_t> &in, uint32_t *out, size_t n) {
+  return utf8_decode_block_lenient(&in.it, in.end, out, n, nullptr);
+}
+
+static size_t decode_block_lenient(lenient_cursor<uint16_t> &in, uint32_t *out, size_t n) {
+  size_t count = 0;
+  bool invalid = false;
+  while (count < n && !in.done()) {
+    count += in.next(out[count], invalid);
+  }
+  return count;
+}
+
+static size_t decode_block_lenient(lenient_cursor<uint32_t> &in, uint32_t *out, size_t n) {
+  size_t count = 0;
+  for (; count < n && in.it != in.end; ++in.it) {
+    out[count++] = utf8::internal::is_code_point_valid(*in.it) ? *in.it : invalid_char_replacement;
+  }
+  return count;
+}
+
+const size_t compare_block_len = 64;
+
+// Code point order, the same as comparing the strings after converting both to the same encoding
+template <typename unit_a, typename unit_b>
+static int compare_lenient(const unit_a *a, size_t a_len, const unit_b *b, size_t b_len) {
+  lenient_cursor<unit_a> a_in(a, a + a_len);
+  lenient_cursor<unit_b> b_in(b, b + b_len);
+  uint32_t a_block[compare_block_len];
+  uint32_t b_block[compare_block_len];
+  size_t a_pos = 0;
+  size_t a_count = 0;
+  size_t b_pos = 0;
+  size_t b_count = 0;
+
+  while (true) {
+    if (a_pos == a_count) {
+      a_pos = 0;
+      a_count = decode_block_lenient(a_in, a_block, compare_block_len);
+    }
+    if (b_pos == b_count) {
+      b_pos = 0;
+      b_count = decode_block_lenient(b_in, b_block, compare_block_len);
+    }
+    if (0 == a_count || 0 == b_count) {
+      return (a_count == b_count) ? 0 : (0 == a_count ? -1 : 1);
+    }
+    const size_t n = std::min(a_count - a_pos, b_count - b_pos);
+    std::pair<uint32_t*, uint32_t*> diff = std::mismatch(a_block + a_pos, a_block + a_pos + n, b_block + b_pos);
+    if (diff.first != a_block + a_pos + n) {
+      return (*diff.first < *diff.second) ? -1 : 1;
+    }
+    a_pos += n;
+    b_pos += n;
+  }
+}
+
+template <typename unit_a, typename unit_b>
+static bool equal_lenient(const unit_a *a, size_t a_len, const unit_b *b, size_t b_len) {
+  return 0 == compare_lenient(a, a_len, b, b_len);
+}
+
+// FNV-1a over the decoded code points, equal strings hash the same in any encoding
+template <typename unit>
+static uint64_t hash_lenient(const unit *in_buf, size_t in_buf_len) {
+  lenient_cursor<unit> in(in_buf, in_buf + in_buf_len);
+  uint32_t block[compare_block_len];
+  uint64_t hash = 14695981039346656037ULL;
+  while (size_t count = decode_block_lenient(in, block, compare_block_len)) {
+    for (size_t i = 0; i < count; i++) {
+      hash = (hash ^ block[i]) * 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+// Limits on replacements before a lenient conversion gives up, either over the whole input
+// or within each consecutive window of window_len input units; window_len == 0 disables the latter
+struct error_budget {
+  size_t max_errors;
+  size_t window_len;
+  size_t max_window_errors;
+};
+
+enum class lenient_status { ok, replaced, too_many_errors };
+
+class error_counter {
+  const error_budget &budget;
+  size_t total = 0;
+  size_t window = 0;
+  size_t window_errors = 0;
+
+ public:
+  explicit error_counter(const error_budget &budget) : budget(budget) {}
+
+  // Returns false once the error at the given input offset exceeds the budget
+  bool add(size_t offset) {
+    total += 1;
+    if (budget.window_len > 0) {
+      if (offset / budget.window_len != window) {
+        window = offset / budget.window_len;
+        window_errors = 0;
+      }
+      window_errors += 1;
+      if (window_errors > budget.max_window_errors) {
+        return false;
+      }
+    }
+    return total <= budget.max_errors;
+  }
+};
+
+// On too_many_errors out holds the conversion of the input before stop_char, which points to
+// the sequence that exceeded the budget; otherwise stop_char is the first invalid sequence or nullptr
+static lenient_status utf8_to_utf16_lenient(const uint8_t *in_buf, size_t in_buf_len, const error_budget &budget,
+    std::vector<uint16_t> &out, const uint8_t** stop_char) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  const uint8_t *fic = utf8::find_invalid(in_buf, in_buf_end);
+  out.clear();
+  std::back_insert_iterator out_bi = std::back_inserter(out);
+  utf8::unchecked::utf8to16(in_buf, fic, out_bi);
+  if (fic == in_buf_end) {
+    if (nullptr != stop_char) {
+      *stop_char = nullptr;
+    }
+    return lenient_status::ok;
+  }
+
+  error_counter errors(budget);
+  const uint8_t *it = fic;
+  while (it != in_buf_end) {
+    const uint8_t *sequence_start = it;
+    uint32_t cp = 0;
+    if (utf8_next_lenient(it, in_buf_end, cp) != utf8::internal::UTF8_OK && !errors.add(sequence_start - in_buf)) {
+      if (nullptr != stop_char) {
+        *stop_char = sequence_start;
+      }
+      return lenient_status::too_many_errors;
+    }
+    utf8::internal::append16_back(cp, out);
+  }
+  if (nullptr != stop_char) {
+    *stop_char = fic;
+  }
+  return lenient_status::replaced;
+}
+
+static lenient_status utf16_to_utf8_lenient(const uint16_t *in_buf, size_t in_buf_len, const error_budget &budget,
+    std::vector<uint8_t> &out, const uint16_t** stop_char) {
+  const uint16_t *in_buf_end = in_buf + in_buf_len;
+  const uint16_t *fic = utf16_find_invalid(in_buf, in_buf_end);
+  // Everything before fic is valid, so no surrogate pair is split after its last BMP unit
+  const uint16_t *clean_end = fic;
+  while (clean_end != in_buf && utf8::internal::is_surrogate(*(clean_end - 1))) {
+    --clean_end;
+  }
+  out.clear();
+  std::back_insert_iterator out_bi = std::back_inserter(out);
+  if (fic == in_buf_end) {
+    utf8::unchecked::utf16to8(in_buf, in_buf_end, out_bi);
+    if (nullptr != stop_char) {
+      *stop_char = nullptr;
+    }
+    return lenient_status::ok;
+  }
+  utf8::unchecked::utf16to8(in_buf, clean_end, out_bi);
+
+  error_counter errors(budget);
+  utf16_lenient_reader reader(clean_end, in_buf_end);
+  while (!reader.done()) {
+    const uint16_t *unit_start = reader.position();
+    uint32_t cp = 0;
+    bool invalid = false;
+    if (!reader.next(cp, invalid)) {
+      break;
+    }
+    if (invalid && !errors.add(unit_start - in_buf)) {
+      if (nullptr != stop_char) {
+        *stop_char = unit_start;
+      }
+      return lenient_status::too_many_errors;
+    }
+    utf8::internal::append_back(cp, out);
+  }
+  if (nullptr != stop_char) {
+    *stop_char = fic;
+  }
+  return lenient_status::replaced;
+}
+
+// One lenient scan of UTF-8 input: the code point count and the UTF-16 length of the result, replacements
+// counting as one U+FFFD each, and the offset of the first invalid sequence or npos when there is none
+static void utf8_lenient_lengths(const uint8_t *in_buf, const uint8_t *in_buf_end, size_t &code_points,
+                                 size_t &utf16_len, size_t &first_invalid) {
+  for (const uint8_t *it = in_buf; it != in_buf_end; ) {
+    const uint8_t *ascii_end = utf8::internal::skip_ascii(it, in_buf_end);
+    code_points += ascii_end - it;
+    utf16_len += ascii_end - it;
+    it = ascii_end;
+    if (it == in_buf_end) {
+      break;
+    }
+    const uint8_t *sequence_start = it;
+    uint32_t cp = 0;
+    if (utf8_next_lenient(it, in_buf_end, cp) != utf8::internal::UTF8_OK && std::string::npos == first_invalid) {
+      first_invalid = sequence_start - in_buf;
+    }
+    code_points += 1;
+    utf16_len += utf8::internal::is_in_bmp(cp) ? 1 : 2;
+  }
+}
+
+// String wrappers over the lenient converters: a counting pass gives the exact result length, so the
+// result is sized once and written through a pointer; first_invalid_pos is the offset of the first
+// invalid unit or npos when there is none
+static std::u16string utf8_to_utf16_lenient(const std::string &in, size_t *first_invalid_pos) {
+  const uint8_t *in_buf = reinterpret_cast<const uint8_t*>(in.data());
+  const uint8_t *in_buf_end = in_buf + in.size();
+  size_t code_points = 0, utf16_len = 0, fip = std::string::npos;
+  utf8_lenient_lengths(in_buf, in_buf_end, code_points, utf16_len, fip);
+  std::u16string res;
+  utf8::internal::write_bounded(res, utf16_len, [&](char16_t *out) {
+    if (std::string::npos == fip) {
+      return utf8::unchecked::utf8to16(in_buf, in_buf_end, out);
+    }
+    for (const uint8_t *it = in_buf; it != in_buf_end; ) {
+      out += utf8::internal::decode_ascii(it, in_buf_end, out, in_buf_end - it);
+      if (it != in_buf_end) {
+        uint32_t cp = 0;
+        utf8_next_lenient(it, in_buf_end, cp);
+        out = utf8::unchecked::append16(cp, out);
+      }
+    }
+    return out;
+  });
+  if (nullptr != first_invalid_pos) {
+    *first_invalid_pos = fip;
+  }
+  return res;
+}
+
+static std::u32string utf8_to_utf32_lenient(const std::string &in, size_t *first_invalid_pos) {
+  const uint8_t *in_buf = reinterpret_cast<const uint8_t*>(in.data());
+  const uint8_t *in_buf_end = in_buf + in.size();
+  size_t code_points = 0, utf16_len = 0, fip = std::string::npos;
+  utf8_lenient_lengths(in_buf, in_buf_end, code_points, utf16_len, fip);
+  std::u32string res;
+  utf8::internal::write_bounded(res, code_points, [&](char32_t *out) {
+    if (std::string::npos == fip) {
+      return utf8::unchecked::utf8to32(in_buf, in_buf_end, out);
+    }
+    for (const uint8_t *it = in_buf; it != in_buf_end; ) {
+      out += utf8::internal::decode_ascii(it, in_buf_end, out, in_buf_end - it);
+      if (it != in_buf_end) {
+        uint32_t cp = 0;
+        utf8_next_lenient(it, in_buf_end, cp);
+        *out++ = cp;
+      }
+    }
+    return out;
+  });
+  if (nullptr != first_invalid_pos) {
+    *first_invalid_pos = fip;
+  }
+  return res;
+}
+
+static std::string utf16_to_utf8_lenient(const std::u16string &in, size_t *first_invalid_pos) {
+  const uint16_t *in_buf = reinterpret_cast<const uint16_t*>(in.data());
+  const uint16_t *in_buf_end = in_buf + in.size();
+  const uint16_t *fic = utf16_find_invalid(in_buf, in_buf_end);
+  const size_t fip = (fic == in_buf_end) ? std::string::npos : fic - in_buf;
+  uint32_t cp = 0;
+  bool invalid = false;
+  size_t res_len = 0;
+  for (utf16_lenient_reader reader(in_buf, in_buf_end); !reader.done(); ) {
+    if (reader.next(cp, invalid)) {
+      res_len += utf8::internal::utf8_length(cp);
+    }
+  }
+  std::string res;
+  utf8::internal::write_bounded(res, res_len, [&](char *out) {
+    for (utf16_lenient_reader reader(in_buf, in_buf_end); !reader.done(); ) {
+      if (reader.next(cp, invalid)) {
+        out = utf8::unchecked::append(cp, out);
+      }
+    }
+    return out;
+  });
+  if (nullptr != first_invalid_pos) {
+    *first_invalid_pos = fip;
+  }
+  return res;
+}
+
+static std::string utf32_to_utf8_lenient(const std::u32string &in, size_t *first_invalid_pos) {
+  size_t fip = std::string::npos;
+  size_t res_len = 0;
+  for (size_t i = 0; i < in.size(); i++) {
+    if (!utf8::internal::is_code_point_valid(in[i]) && std::string::npos == fip) {
+      fip = i;
+    }
+    res_len += utf32_utf8_length(in[i]);
+  }
+  std::string res;
+  utf8::internal::write_bounded(res, res_len, [&](char *out) {
+    for (size_t i = 0; i < in.size(); i++) {
+      uint32_t cp = in[i];
+      if (!utf8::internal::is_code_point_valid(cp)) {
+        cp = invalid_char_replacement;
+      }
+      out = utf8::unchecked::append(cp, out);
+    }
+    return out;
+  });
+  if (nullptr != first_invalid_pos) {
+    *first_invalid_pos = fip;
+  }
+  return res;
+}
+
+// UTF-8 text plus what a single lenient scan tells about it. The UTF-16 form is built on first
+// request and cached: concurrent first requests may each build one, the first to be published
+// wins and the others are discarded, so reads never take a lock.
+class lazy_utf16_string {
+  std::string octets;
+  size_t first_invalid = std::string::npos;
+  size_t code_points = 0;
+  size_t utf16_len = 0;
+  mutable std::atomic<const std::u16string*> utf16_cache{nullptr};
+
+  // Replacements count as one U+FFFD each
+  void scan() {
+    const uint8_t *in_buf = reinterpret_cast<const uint8_t*>(octets.data());
+    utf8_lenient_lengths(in_buf, in_buf + octets.size(), code_points, utf16_len, first_invalid);
+  }
+
+  // The length is known, so the result is sized exactly; valid text takes the unchecked path
+  std::unique_ptr<std::u16string> materialize() const {
+    const uint8_t *in_buf = reinterpret_cast<const uint8_t*>(octets.data());
+    const uint8_t *in_buf_end = in_buf + octets.size();
+    std::unique_ptr<std::u16string> res(new std::u16string());
+    utf8::internal::write_bounded(*res, utf16_len, [&](char16_t *out) {
+      if (is_valid()) {
+        return utf8::unchecked::utf8to16(in_buf, in_buf_end, out);
+      }
+      for (const uint8_t *it = in_buf; it != in_buf_end; ) {
+        out += utf8::internal::decode_ascii(it, in_buf_end, out, in_buf_end - it);
+        if (it != in_buf_end) {
+          uint32_t cp = 0;
+          utf8_next_lenient(it, in_buf_end, cp);
+          out = utf8::unchecked::append16(cp, out);
+        }
+      }
+      return out;
+    });
+    return res;
+  }
+
+ public:
+  explicit lazy_utf16_string(std::string in) : octets(std::move(in)) {
+    scan();
+  }
+
+  lazy_utf16_string(const uint8_t *in_buf, size_t in_buf_len) : octets(reinterpret_cast<const char*>(in_buf), in_buf_len) {
+    scan();
+  }
+
+  // A copy builds its own UTF-16 form when asked for it
+  lazy_utf16_string(const lazy_utf16_string &other) : octets(other.octets), first_invalid(other.first_invalid),
+      code_points(other.code_points), utf16_len(other.utf16_len) {}
+
+  lazy_utf16_string &operator=(const lazy_utf16_string &) = delete;
+
+  ~lazy_utf16_string() {
+    delete utf16_cache.load(std::memory_order_acquire);
+  }
+
+  const std::string &utf8_str() const { return octets; }
+  bool is_valid() const { return std::string::npos == first_invalid; }
+  // Octet offset of the first invalid sequence, or npos
+  size_t first_invalid_pos() const { return first_invalid; }
+  size_t code_point_count() const { return code_points; }
+  size_t utf16_length() const { return utf16_len; }
+  bool has_utf16() const { return nullptr != utf16_cache.load(std::memory_order_acquire); }
+
+  const std::u16string &utf16() const {
+    const std::u16string *cached = utf16_cache.load(std::memory_order_acquire);
+    if (nullptr != cached) {
+      return *cached;
+    }
+    std::unique_ptr<std::u16string> fresh = materialize();
+    // On failure cached holds the string another thread published first
+    if (utf16_cache.compare_exchange_strong(cached, fresh.get(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+      return *fresh.release();
+    }
+    return *cached;
+  }
+};
+
+template <bool big_endian>
+static uint16_t load_utf16_unit(const uint8_t *ptr) {
+  return big_endian ? static_cast<uint16_t>((ptr[0] << 8) | ptr[1]) : static_cast<uint16_t>(ptr[0] | (ptr[1] << 8));
+}
+
+template <bool big_endian>
+static uint8_t *store_utf16_unit(uint32_t unit, uint8_t *ptr) {
+  *ptr++ = static_cast<uint8_t>(big_endian ? unit >> 8 : unit);
+  *ptr++ = static_cast<uint8_t>(big_endian ? unit : unit >> 8);
+  return ptr;
+}
+
+// Word mask that is zero when all the UTF-16 units in the word are ASCII
+template <bool big_endian>
+static size_t utf16_ascii_mask() {
+  uint8_t octets[sizeof(size_t)];
+  for (size_t i = 0; i < sizeof(size_t); i++) {
+    octets[i] = ((i % 2 == 0) == big_endian) ? 0xff : 0x80;
+  }
+  return utf8::internal::load_word(octets);
+}
+
+// Reads UTF-16 units of the given byte order directly from the octets, a trailing odd octet is invalid
+template <bool big_endian>
+static std::vector<uint8_t> utf16_bytes_to_utf8_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  const size_t ascii_mask = utf16_ascii_mask<big_endian>();
+  const uint8_t *in_buf_end = in_buf + (in_buf_len & ~static_cast<size_t>(1));
+  const uint8_t *fic = nullptr;
+  std::vector<uint8_t> res(in_buf_len / 2 * 3 + 3);
+  uint8_t *out = res.data();
+
+  const uint8_t *it = in_buf;
+  while (it != in_buf_end) {
+    if (utf8::internal::has_full_word(it, in_buf_end) && !(utf8::internal::load_word(it) & ascii_mask)) {
+      for (size_t i = big_endian ? 1 : 0; i < sizeof(size_t); i += 2) {
+        *out++ = it[i];
+      }
+      it += sizeof(size_t);
+      continue;
+    }
+    const uint8_t *unit_start = it;
+    uint32_t cp = load_utf16_unit<big_endian>(it);
+    it += 2;
+    if (utf8::internal::is_lead_surrogate(cp) && it != in_buf_end && utf8::internal::is_trail_surrogate(load_utf16_unit<big_endian>(it))) {
+      cp = (cp << 10) + load_utf16_unit<big_endian>(it) + utf8::internal::SURROGATE_OFFSET;
+      it += 2;
+    } else if (utf8::internal::is_surrogate(cp)) {
+      cp = invalid_char_replacement;
+      if (nullptr == fic) {
+        fic = unit_start;
+      }
+    }
+    out = utf8::unchecked::append(cp, out);
+  }
+  if (in_buf_len % 2 != 0) {
+    out = utf8::unchecked::append(invalid_char_replacement, out);
+    if (nullptr == fic) {
+      fic = in_buf_end;
+    }
+  }
+
+  res.resize(out - res.data());
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
+  }
+  return res;
+}
+
+template <bool big_endian>
+static std::vector<uint8_t> utf8_to_utf16_bytes_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  const uint8_t *fic = nullptr;
+  std::vector<uint8_t> res(in_buf_len * 2);
+  uint8_t *out = res.data();
+
+  const uint8_t *it = in_buf;
+  while (it != in_buf_end) {
+    if (utf8::internal::has_full_word(it, in_buf_end) && !(utf8::internal::load_word(it) & utf8::internal::WORD_HIGH_BITS)) {
+      for (size_t i = 0; i < sizeof(size_t); i++) {
+        out = store_utf16_unit<big_endian>(it[i], out);
+      }
+      it += sizeof(size_t);
+      continue;
+    }
+    const uint8_t *sequence_start = it;
+    uint32_t cp = 0;
+    if (utf8_next_lenient(it, in_buf_end, cp) != utf8::internal::UTF8_OK && nullptr == fic) {
+      fic = sequence_start;
+    }
+    if (utf8::internal::is_in_bmp(cp)) {
+      out = store_utf16_unit<big_endian>(cp, out);
+    } else {
+      out = store_utf16_unit<big_endian>(utf8::internal::LEAD_OFFSET + (cp >> 10), out);
+      out = store_utf16_unit<big_endian>(utf8::internal::TRAIL_SURROGATE_MIN + (cp & 0x3ff), out);
+    }
+  }
+
+  res.resize(out - res.data());
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
+  }
+  return res;
+}
+
+static std::vector<uint8_t> utf16le_to_utf8_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  return utf16_bytes_to_utf8_lenient<false>(in_buf, in_buf_len, first_invalid_char);
+}
+
+static std::vector<uint8_t> utf16be_to_utf8_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  return utf16_bytes_to_utf8_lenient<true>(in_buf, in_buf_len, first_invalid_char);
+}
+
+static std::vector<uint8_t> utf8_to_utf16le_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  return utf8_to_utf16_bytes_lenient<false>(in_buf, in_buf_len, first_invalid_char);
+}
+
+static std::vector<uint8_t> utf8_to_utf16be_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  return utf8_to_utf16_bytes_lenient<true>(in_buf, in_buf_len, first_invalid_char);
+}
+
+template <bool big_endian>
+static std::vector<uint8_t> utf32_bytes_to_utf8_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  const uint8_t *in_buf_end = in_buf + (in_buf_len & ~static_cast<size_t>(3));
+  const uint8_t *fic = nullptr;
+  std::vector<uint8_t> res;
+  res.reserve(in_buf_len);
+
+  for (const uint8_t *it = in_buf; it != in_buf_end; it += 4) {
+    uint32_t cp = big_endian ? (load_utf16_unit<true>(it) << 16) | load_utf16_unit<true>(it + 2) :
+        load_utf16_unit<false>(it) | (load_utf16_unit<false>(it + 2) << 16);
+    if (!utf8::internal::is_code_point_valid(cp)) {
+      cp = invalid_char_replacement;
+      if (nullptr == fic) {
+        fic = it;
+      }
+    }
+    utf8::internal::append_back(cp, res);
+  }
+  if (in_buf_len % 4 != 0) {
+    utf8::internal::append_back(invalid_char_replacement, res);
+    if (nullptr == fic) {
+      fic = in_buf_end;
+    }
+  }
+
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = fic;
+  }
+  return res;
+}
+
+// Picks the encoding from the byte order mark, input without one is taken as UTF-8.
+// The mark itself is not copied to the output.
+static std::vector<uint8_t> bom_to_utf8_lenient(const uint8_t *in_buf, size_t in_buf_len, const uint8_t** first_invalid_char) {
+  const utf8::bom_type bom = utf8::detect_bom(in_buf, in_buf + in_buf_len);
+  in_buf += utf8::bom_length(bom);
+  in_buf_len -= utf8::bom_length(bom);
+
+  switch (bom) {
+    case utf8::UTF16LE_BOM:
+      return utf16le_to_utf8_lenient(in_buf, in_buf_len, first_invalid_char);
+    case utf8::UTF16BE_BOM:
+      return utf16be_to_utf8_lenient(in_buf, in_buf_len, first_invalid_char);
+    case utf8::UTF32LE_BOM:
+      return utf32_bytes_to_utf8_lenient<false>(in_buf, in_buf_len, first_invalid_char);
+    case utf8::UTF32BE_BOM:
+      return utf32_bytes_to_utf8_lenient<true>(in_buf, in_buf_len, first_invalid_char);
+    default:
+      break;
+  }
+
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  const uint8_t *fic = utf8::find_invalid(in_buf, in_buf_end);
+  std::vector<uint8_t> res;
+  res.reserve(in_buf_len);
+  utf8::replace_invalid(in_buf, in_buf_end, std::back_inserter(res), invalid_char_replacement);
+  if (nullptr != first_invalid_char) {
+    *first_invalid_char = (fic == in_buf_end) ? nullptr : fic;
+  }
+  return res;
+}
+
+enum class sniffed_encoding { ascii, utf8, utf16le, utf16be, utf32le, utf32be, binary };
+
+struct sniff_result {
+  sniffed_encoding encoding;
+  bool ascii_only;
+  // 0 to 100, 100 when a BOM or the whole input decides the answer
+  unsigned confidence;
+  // First invalid UTF-8 sequence, nullptr when the input is valid UTF-8 or was not scanned as UTF-8
+  const uint8_t *first_invalid_char;
+};
+
+const size_t sniff_sample_len = 512;
+
+static bool is_binary_control(uint8_t octet) {
+  return octet < 0x20 && octet != '\t' && octet != '\n' && octet != '\r' && octet != '\f' && octet != 0x1b;
+}
+
+// Classifies the input in a single forward scan. A BOM decides immediately, NUL octets or too many
+// control octets in the leading sample decide between UTF-16 and binary without looking further,
+// otherwise the input is validated as UTF-8 up to the first invalid sequence.
+static sniff_result sniff_encoding(const uint8_t *in_buf, size_t in_buf_len) {
+  const uint8_t *in_buf_end = in_buf + in_buf_len;
+  switch (utf8::detect_bom(in_buf, in_buf_end)) {
+    case utf8::UTF16LE_BOM:
+      return { sniffed_encoding::utf16le, false, 100, nullptr };
+    case utf8::UTF16BE_BOM:
+      return { sniffed_encoding::utf16be, false, 100, nullptr };
+    case utf8::UTF32LE_BOM:
+      return { sniffed_encoding::utf32le, false, 100, nullptr };
+    case utf8::UTF32BE_BOM:
+      return { sniffed_encoding::utf32be, false, 100, nullptr };
+    case utf8::UTF8_BOM:
+      in_buf += sizeof(utf8::bom);
+      break;
+    default:
+      break;
+  }
+
+  const size_t sample_len = std::min(static_cast<size_t>(in_buf_end - in_buf), sniff_sample_len);
+  size_t zeros[2] = { 0, 0 };
+  size_t controls = 0;
+  bool ascii_sample = true;
+  for (size_t i = 0; i < sample_len; i++) {
+    if (0 == in_buf[i]) {
+      zeros[i % 2] += 1;
+    } else if (is_binary_control(in_buf[i])) {
+      controls += 1;
+    }
+    ascii_sample = ascii_sample && in_buf[i] < 0x80;
+  }
+
+  if (zeros[0] + zeros[1] > 0) {
+    const size_t units = std::max(sample_len / 2, static_cast<size_t>(1));
+    // Latin text in UTF-16 has a zero high octet in most units and almost never a zero low octet
+    for (size_t high = 0; high < 2; high++) {
+      if (zeros[high] * 4 >= units && zeros[1 - high] * 8 <= zeros[high]) {
+        const sniffed_encoding encoding = (1 == high) ? sniffed_encoding::utf16le : sniffed_encoding::utf16be;
+        const unsigned confidence = static_cast<unsigned>(std::min<size_t>(99, 50 + zeros[high] * 50 / units));
+        return { encoding, false, confidence, nullptr };
+      }
+    }
+    return { sniffed_encoding::binary, false, 90, nullptr };
+  }
+
+  if (controls * 16 > sample_len) {
+    // Only the sample is validated, a sequence cut off at its end counts as valid
+    const uint8_t *sample_end = in_buf + sample_len;
+    utf8::internal::utf_error err = utf8::internal::UTF8_OK;
+    for (const uint8_t *it = in_buf; err == utf8::internal::UTF8_OK; ) {
+      it = utf8::internal::skip_ascii(it, sample_end);
+      if (it == sample_end) {
+        break;
+      }
+      err = utf8::internal::validate_next(it, sample_end);
+    }
+    const bool valid_sample = (utf8::internal::UTF8_OK == err || utf8::internal::NOT_ENOUGH_ROOM == err);
+    const bool ascii_only = ascii_sample && sample_end == in_buf_end;
+    return { sniffed_encoding::binary, ascii_only, valid_sample ? 60u : 90u, nullptr };
+  }
+
+  bool ascii_only = true;
+  const uint8_t *fic = nullptr;
+  const uint8_t *it = in_buf;
+  while (true) {
+    it = utf8::internal::skip_ascii(it, in_buf_end);
+    if (it == in_buf_end) {
+      break;
+    }
+    ascii_only = false;
+    const uint8_t *sequence_start = it;
+    if (utf8::internal::validate_next(it, in_buf_end) != utf8::internal::UTF8_OK) {
+      fic = sequence_start;
+      break;
+    }
+  }
+
+  if (nullptr != fic) {
+    // Text-like but not valid UTF-8, lenient conversion will replace the invalid sequences
+    return { sniffed_encoding::utf8, false, 50, fic };
+  }
+  return { ascii_only ? sniffed_encoding::ascii : sniffed_encoding::utf8, ascii_only, 100, nullptr };
+}
+
+static void assert(bool check, const std::string &label) {
+  if (!check) {
+    std::cerr << "Assertion failed: " << label << std::endl;
+    std::exit(1);
+  }
+}
+
+static void test_utf8_to_utf16() {
+  {
+    auto res = utf8_to_utf16_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), nullptr);
+    assert(res == hello_bg_utf16, "hello_bg_utf8 1");
+  }
+  {
+    const uint8_t val = 42;
+    const uint8_t *ptr = &val;
+    auto res = utf8_to_utf16_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr);
+    assert(res == hello_bg_utf16, "hello_bg_utf8 2 1");
+    assert(ptr == nullptr, "hello_bg_utf8 2 2");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    auto res = utf8_to_utf16_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), &ptr);
+    assert(ptr != nullptr, "invalid_utf8_continuation 1");
+    assert(ptr - invalid_utf8_continuation.data() == 1, "invalid_utf8_continuation 2");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    auto res = utf8_to_utf16_lenient(incomplete_utf8_sequence.data(), incomplete_utf8_sequence.size(), &ptr);
+    assert(ptr != nullptr, "incomplete_utf8_sequence 1");
+    assert(ptr - incomplete_utf8_sequence.data() == 0, "incomplete_utf8_sequence 2");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    auto res = utf8_to_utf16_lenient(invalid_overlong_utf8.data(), invalid_overlong_utf8.size(), &ptr);
+    assert(ptr != nullptr, "invalid_overlong_utf8 1");
+    assert(ptr - invalid_overlong_utf8.data() == 0, "invalid_overlong_utf8 2");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    std::vector<uint8_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    std::copy(invalid_utf8_continuation.begin(), invalid_utf8_continuation.end(), in_buf_bi);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    auto res = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr != nullptr, "hello invalid_utf8_continuation 1");
+    assert((ptr - in_buf.data()) == 19, "hello invalid_utf8_continuation 2");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin()), "hello invalid_utf8_continuation 3");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin() + 12), "hello invalid_utf8_continuation 4");
+    assert(res[hello_bg_utf16.size()] == 0x48, "hello invalid_utf8_continuation 5");
+    assert(res[hello_bg_utf16.size() + 1] == invalid_char_replacement, "hello invalid_utf8_continuation 6");
+    assert(res[hello_bg_utf16.size() + 2] == 0x65, "hello invalid_utf8_continuation 7");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    std::vector<uint8_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    std::copy(incomplete_utf8_sequence.begin(), incomplete_utf8_sequence.end(), in_buf_bi);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    auto res = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr != nullptr, "hello incomplete_utf8_sequence 1");
+    assert((ptr - in_buf.data()) == 18, "hello incomplete_utf8_sequence 2");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin()), "hello incomplete_utf8_sequence 3");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin() + 10), "hello incomplete_utf8_sequence 4");
+    assert(res[hello_bg_utf16.size()] == invalid_char_replacement, "hello incomplete_utf8_sequence 5");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    std::vector<uint8_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    std::copy(invalid_overlong_utf8.begin(), invalid_overlong_utf8.end(), in_buf_bi);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    auto res = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr != nullptr, "hello invalid_overlong_utf8 1");
+    assert((ptr - in_buf.data()) == 18, "hello invalid_overlong_utf8 2");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin()), "hello invalid_overlong_utf8 3");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), res.begin() + 10), "hello invalid_overlong_utf8 4");
+    assert(res[hello_bg_utf16.size()] == invalid_char_replacement, "hello invalid_overlong_utf8 5");
+  }
+}
+
+void test_utf16_find_invalid() {
+  {
+    auto res = utf16_find_invalid(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end()); 
+    assert(res != invalid_utf16_surrogate.end(), "find invalid_utf16_surrogate 1");
+  }
+  {
+    auto res = utf16_find_invalid(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end()); 
+    assert(res != incomplete_utf16_surrogate.end(), "find incomplete_utf16_surrogate 1");
+  }
+  {
+    auto res = utf16_find_invalid(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end());
+    assert(res == valid_utf16_surrogate.end(), "find valid_utf16_surrogate 1");
+  }
+  {
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    auto res = utf16_find_invalid(in_buf.begin(), in_buf.end());
+    assert((res - in_buf.begin()) == hello_bg_utf16.size() + 1, "find hello invalid_utf16_surrogate 1");
+  }
+  {
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    auto res = utf16_find_invalid(in_buf.begin(), in_buf.end());
+    assert((res - in_buf.begin()) == hello_bg_utf16.size() + 1, "find hello incomplete_utf16_surrogate 1");
+  }
+  {
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    auto res = utf16_find_invalid(in_buf.begin(), in_buf.end());
+    assert(res == in_buf.end(), "find hello valid_utf16_surrogate 1");
+  }
+}
+
+static void test_utf16_replace_invalid() {
+  {
+    std::vector<uint16_t> replaced;
+    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
+    utf16_replace_invalid(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), replaced_bi, invalid_char_replacement);
+    assert(replaced.size() == 2, "replace invalid_utf16_surrogate 1");
+    assert(replaced[0] == invalid_char_replacement, "replace invalid_utf16_surrogate 2");
+    assert(replaced[1] == invalid_char_replacement, "replace invalid_utf16_surrogate 3");
+  }
+  {
+    std::vector<uint16_t> replaced;
+    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
+    utf16_replace_invalid(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), replaced_bi, invalid_char_replacement);
+    assert(replaced.size() == 1, "replace incomplete_utf16_surrogate 1");
+    assert(replaced[0] == invalid_char_replacement, "replace incomplete_utf16_surrogate 2");
+  }
+  {
+    std::vector<uint16_t> replaced;
+    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
+    utf16_replace_invalid(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), replaced_bi, invalid_char_replacement);
+    assert(replaced == valid_utf16_surrogate, "replace valid_utf16_surrogate 1");
+  }
+  {
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::vector<uint16_t> replaced;
+    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
+    utf16_replace_invalid(in_buf.begin(), in_buf.end(), replaced_bi, invalid_char_replacement);
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin()), "replace hello invalid_utf16_surrogate 1");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin() + 11), "replace hello invalid_utf16_surrogate 2");
+    assert(replaced[9] == invalid_char_replacement, "replace hello invalid_utf16_surrogate 3");
+    assert(replaced[10] == invalid_char_replacement, "replace hello invalid_utf16_surrogate 4");
+  }
+  {
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::vector<uint16_t> replaced;
+    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
+    utf16_replace_invalid(in_buf.begin(), in_buf.end(), replaced_bi, invalid_char_replacement);
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin()), "replace hello incomplete_utf16_surrogate 1");
+    assert(std::equal(hello_bg_utf16.begin(), hello_bg_utf16.end(), replaced.begin() + 10), "replace hello incomplete_utf16_surrogate 2");
+    assert(replaced[9] == invalid_char_replacement, "replace hello incomplete_utf16_surrogate 3");
+  }
+  {
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::vector<uint16_t> replaced;
+    std::back_insert_iterator replaced_bi = std::back_inserter(replaced);
+    utf16_replace_invalid(in_buf.begin(), in_buf.end(), replaced_bi, invalid_char_replacement);
+    assert(replaced == in_buf, "replace hello valid_utf16_surrogate 1");
+  }
+}
+
+static void test_utf16_to_utf8() {
+  {
+    auto res = utf16_to_utf8_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), nullptr);
+    assert(res == hello_bg_utf8, "hello_bg_utf16 1");
+  }
+  {
+    const uint16_t val = 42;
+    const uint16_t *ptr = &val;
+    auto res = utf16_to_utf8_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), &ptr);
+    assert(res == hello_bg_utf8, "hello_bg_utf16 2 1");
+    assert(ptr == nullptr, "hello_bg_utf16 2 2");
+  }
+  {
+    const uint16_t *ptr = nullptr;
+    auto res = utf16_to_utf8_lenient(invalid_utf16_surrogate.data(), invalid_utf16_surrogate.size(), &ptr);
+    assert(ptr != nullptr, "invalid_utf16_surrogate 1");
+    assert(ptr - invalid_utf16_surrogate.data() == 1, "invalid_utf16_surrogate 2");
+  }
+  {
     const uint16_t *ptr = nullptr;
     auto res = utf16_to_utf8_lenient(incomplete_utf16_surrogate.data(), incomplete_utf16_surrogate.size(), &ptr);
     assert(ptr != nullptr, "incomplete_utf16_surrogate 1");
     assert(ptr - incomplete_utf16_surrogate.data() == 0, "incomplete_utf16_surrogate 2");
   }
   {
-    const uint16_t *ptr = nullptr;
-    auto res = utf16_to_utf8_lenient(valid_utf16_surrogate.data(), valid_utf16_surrogate.size(), &ptr);
-    assert(ptr == nullptr, "valid_utf16_surrogate 1");
+    const uint16_t *ptr = nullptr;
+    auto res = utf16_to_utf8_lenient(valid_utf16_surrogate.data(), valid_utf16_surrogate.size(), &ptr);
+    assert(ptr == nullptr, "valid_utf16_surrogate 1");
+  }
+  {
+    const uint16_t *ptr = nullptr;
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    auto res = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr != nullptr, "hello invalid_utf16_surrogate 1");
+    assert((ptr - in_buf.data()) == 10, "hello invalid_utf16_surrogate 2");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "hello invalid_utf16_surrogate 3");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin() + 24), "hello invalid_utf16_surrogate 4");
+    assert(res[hello_bg_utf8.size() + 0] == 0xef, "hello invalid_utf16_surrogate 5");
+    assert(res[hello_bg_utf8.size() + 1] == 0xbf, "hello invalid_utf16_surrogate 6");
+    assert(res[hello_bg_utf8.size() + 2] == 0xbd, "hello invalid_utf16_surrogate 7");
+    assert(res[hello_bg_utf8.size() + 3] == 0xef, "hello invalid_utf16_surrogate 8");
+    assert(res[hello_bg_utf8.size() + 4] == 0xbf, "hello invalid_utf16_surrogate 9");
+    assert(res[hello_bg_utf8.size() + 5] == 0xbd, "hello invalid_utf16_surrogate 10");
+  }
+  {
+    const uint16_t *ptr = nullptr;
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    auto res = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr != nullptr, "hello incomplete_utf16_surrogate 1");
+    assert((ptr - in_buf.data()) == 10, "hello incomplete_utf16_surrogate 2");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "hello incomplete_utf16_surrogate 3");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin() + 21), "hello incomplete_utf16_surrogate 4");
+    assert(res[hello_bg_utf8.size() + 0] == 0xef, "hello incomplete_utf16_surrogate 5");
+    assert(res[hello_bg_utf8.size() + 1] == 0xbf, "hello incomplete_utf16_surrogate 6");
+    assert(res[hello_bg_utf8.size() + 2] == 0xbd, "hello incomplete_utf16_surrogate 7");
+  }
+  {
+    const uint16_t *ptr = nullptr;
+    std::vector<uint16_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    std::copy(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), in_buf_bi);
+    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
+    auto res = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr == nullptr, "hello valid_utf16_surrogate 1");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "hello valid_utf16_surrogate 3");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin() + 22), "hello valid_utf16_surrogate 4");
+    assert(res[hello_bg_utf8.size() + 0] == 0xf0, "hello valid_utf16_surrogate 5");
+    assert(res[hello_bg_utf8.size() + 1] == 0x90, "hello valid_utf16_surrogate 6");
+    assert(res[hello_bg_utf8.size() + 2] == 0x80, "hello valid_utf16_surrogate 7");
+    assert(res[hello_bg_utf8.size() + 3] == 0x80, "hello valid_utf16_surrogate 8");
+  }
+}
+
+// Every reader of UTF-16 input agrees with utf16_to_utf8_lenient, which converts the output of
+// utf16_replace_invalid and reports the offset found by utf16_find_invalid
+static void test_utf16_recovery() {
+  const std::vector<std::vector<uint16_t>> inputs = {
+    hello_bg_utf16, valid_utf16_surrogate, { 0x61, 0xdc00, 0x62 }, { 0x61, 0xd800, 0x62 }, { 0xd800, 0xd800, 0xdc00 },
+    { 0xd800, 0xdc00, 0xdc00 }, { 0x61, 0xd800 }, { 0xd800, 0xd800 }, { 0xd800, 0xd800, 0xd800, 0x62 },
+    { 0xd800, 0xd800, 0xd800, 0xdc00 }, { 0x61, 0xdc00 }, { 0xdc00, 0xdc00 }, {},
+  };
+  const error_budget unlimited = { SIZE_MAX, 0, 0 };
+  for (const auto &in : inputs) {
+    const uint16_t *in_buf = in.data();
+    const uint16_t *expected_ptr = nullptr;
+    const std::vector<uint8_t> expected = utf16_to_utf8_lenient(in_buf, in.size(), &expected_ptr);
+    const size_t expected_pos = (nullptr == expected_ptr) ? std::string::npos : expected_ptr - in_buf;
+
+    const uint16_t *ptr = nullptr;
+    const std::vector<uint32_t> res32 = utf16_to_utf32_lenient(in_buf, in.size(), &ptr);
+    std::vector<uint8_t> res8;
+    for (uint32_t cp : res32) {
+      utf8::unchecked::append(cp, std::back_inserter(res8));
+    }
+    assert(res8 == expected && ptr == expected_ptr, "utf16 recovery utf16to32");
+
+    // One code point per block, so the reader state has to carry over between blocks
+    lenient_cursor<uint16_t> cursor(in_buf, in_buf + in.size());
+    std::vector<uint32_t> blocks;
+    uint32_t cp = 0;
+    while (decode_block_lenient(cursor, &cp, 1)) {
+      blocks.push_back(cp);
+    }
+    assert(blocks == res32, "utf16 recovery decode_block");
+
+    std::vector<uint8_t> out;
+    utf16_to_utf8_lenient(in_buf, in.size(), unlimited, out, &ptr);
+    assert(out == expected && ptr == expected_ptr, "utf16 recovery budget");
+
+    size_t pos = 0;
+    const std::string str = utf16_to_utf8_lenient(std::u16string(in.begin(), in.end()), &pos);
+    assert(std::equal(str.begin(), str.end(), expected.begin(), expected.end(), [](char a, uint8_t b) { return uint8_t(a) == b; }) &&
+        pos == expected_pos, "utf16 recovery string");
+  }
+}
+
+static void test_decode_block() {
+  {
+    std::vector<uint8_t> in_buf(20, 0x41);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), std::back_inserter(in_buf));
+    const uint8_t *it = in_buf.data();
+    const uint8_t *end = in_buf.data() + in_buf.size();
+    std::vector<uint32_t> out(16);
+    size_t count = utf8::decode_block(it, end, out.data(), out.size());
+    assert(count == 16, "decode_block checked 1");
+    assert(it - in_buf.data() == 16, "decode_block checked 2");
+    count = utf8::decode_block(it, end, out.data(), out.size());
+    assert(count == 4 + hello_bg_utf16.size(), "decode_block checked 3");
+    assert(out[3] == 0x41 && out[4] == hello_bg_utf16[0], "decode_block checked 4");
+    assert(it == end, "decode_block checked 5");
+  }
+  {
+    const uint8_t *it = invalid_utf8_continuation.data();
+    const uint8_t *end = it + invalid_utf8_continuation.size();
+    uint32_t out[4];
+    size_t count = utf8::decode_block(it, end, out, 4);
+    assert(count == 1 && out[0] == 0x48, "decode_block checked invalid 1");
+    assert(it - invalid_utf8_continuation.data() == 1, "decode_block checked invalid 2");
+    bool thrown = false;
+    try {
+      utf8::decode_block(it, end, out, 4);
+    } catch (const utf8::invalid_utf8&) {
+      thrown = true;
+    }
+    assert(thrown, "decode_block checked invalid 3");
+  }
+  {
+    const uint8_t *it = hello_bg_utf8.data();
+    uint32_t out[4];
+    size_t count = utf8::unchecked::decode_block(it, hello_bg_utf8.data() + hello_bg_utf8.size(), out, 4);
+    assert(count == 4, "decode_block unchecked 1");
+    assert(out[3] == hello_bg_utf16[3], "decode_block unchecked 2");
+    assert(it - hello_bg_utf8.data() == 8, "decode_block unchecked 3");
+  }
+  {
+    std::vector<uint8_t> in_buf;
+    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
+    std::copy(hello_bg_utf8.begin(), hello_bg_utf8.end(), in_buf_bi);
+    std::copy(invalid_overlong_utf8.begin(), invalid_overlong_utf8.end(), in_buf_bi);
+    std::copy(incomplete_utf8_sequence.begin(), incomplete_utf8_sequence.end(), in_buf_bi);
+    const uint8_t *it = in_buf.data();
+    const uint8_t *ptr = nullptr;
+    std::vector<uint32_t> out(32);
+    size_t count = utf8_decode_block_lenient(&it, in_buf.data() + in_buf.size(), out.data(), out.size(), &ptr);
+    assert(count == hello_bg_utf16.size() + 2, "decode_block lenient 1");
+    assert(ptr - in_buf.data() == 18, "decode_block lenient 2");
+    assert(out[hello_bg_utf16.size()] == invalid_char_replacement, "decode_block lenient 3");
+    assert(out[hello_bg_utf16.size() + 1] == invalid_char_replacement, "decode_block lenient 4");
+    assert(it == in_buf.data() + in_buf.size(), "decode_block lenient 5");
+  }
+}
+
+static void test_offset_index() {
+  std::vector<uint8_t> doc;
+  for (int i = 0; i < 20; i++) {
+    doc.insert(doc.end(), 13, 0x61);
+    doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+    doc.insert(doc.end(), { 0xf0, 0x90, 0x80, 0x80 });
+  }
+  const uint8_t *begin = doc.data();
+  const uint8_t *end = begin + doc.size();
+  utf8::offset_index index(5);
+  for (size_t len = 0; len < doc.size(); len += 7) {
+    index.append(begin, begin + len);
+  }
+  index.append(begin, end);
+  assert(index.octet_count() == doc.size(), "offset_index 1");
+  assert(index.code_point_count() == static_cast<size_t>(utf8::unchecked::distance(begin, end)), "offset_index 2");
+  assert(index.utf16_length() == 20 * (13 + hello_bg_utf16.size() + 2), "offset_index 3");
+  const uint8_t *it = begin;
+  size_t utf16_units = 0;
+  for (size_t cp_idx = 0; cp_idx < index.code_point_count(); cp_idx++) {
+    utf8::offset_index::position pos = index.locate_code_point(begin, cp_idx);
+    assert(pos.octets == static_cast<size_t>(it - begin), "offset_index locate_code_point 1");
+    assert(pos.utf16_units == utf16_units, "offset_index locate_code_point 2");
+    assert(index.locate_octet(begin, pos.octets).code_points == cp_idx, "offset_index locate_octet 1");
+    assert(index.locate_utf16(begin, utf16_units).code_points == cp_idx, "offset_index locate_utf16 1");
+    assert(index.code_point_at(begin, cp_idx) == utf8::unchecked::peek_next(it), "offset_index code_point_at 1");
+    utf16_units += utf8::unchecked::next(it) > 0xffff ? 2 : 1;
+  }
+  {
+    const uint8_t *pos = begin;
+    index.advance(begin, pos, 100);
+    const uint8_t *expected = begin;
+    utf8::unchecked::advance(expected, 100);
+    assert(pos == expected, "offset_index advance 1");
+    index.advance(begin, pos, -40);
+    utf8::unchecked::advance(expected, -40);
+    assert(pos == expected, "offset_index advance 2");
+    assert(index.distance(begin, pos, end) == utf8::unchecked::distance(pos, end), "offset_index distance 1");
+    // offsets inside a sequence round down to its lead octet
+    assert(index.locate_octet(begin, 14).octets == 13, "offset_index locate_octet 2");
+    assert(index.locate_utf16(begin, 23).utf16_units == 22, "offset_index locate_utf16 2");
+  }
+}
+
+static void check_position_map(const utf8::position_map &map, const std::vector<uint8_t> &doc, const std::string &label) {
+  utf8::position_map expected(3);
+  expected.assign(doc.data(), doc.data() + doc.size());
+  assert(map.line_count() == expected.line_count(), label + " line_count");
+  assert(map.first_invalid() == expected.first_invalid(), label + " first_invalid");
+  assert(map.index().code_point_count() == expected.index().code_point_count(), label + " code_point_count");
+  assert(map.index().utf16_length() == expected.index().utf16_length(), label + " utf16_length");
+  size_t line = 0;
+  size_t column = 0;
+  for (size_t i = 0; i < doc.size(); i++) {
+    if (utf8::internal::is_trail(doc[i])) {
+      continue;
+    }
+    utf8::position_map::line_column lc = map.to_line_column(doc.data(), i);
+    assert(lc.line == line && lc.column == column, label + " to_line_column");
+    assert(map.to_octet(doc.data(), lc) == i, label + " to_octet");
+    if (doc[i] == '\n') {
+      line++;
+      column = 0;
+    } else {
+      column += doc[i] >= 0xf0 ? 2 : 1;
+    }
+  }
+}
+
+static void test_position_map() {
+  std::vector<uint8_t> doc;
+  for (int i = 0; i < 10; i++) {
+    doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+    doc.insert(doc.end(), { 0x20, 0xf0, 0x90, 0x80, 0x80, 0x0a });
+  }
+  utf8::position_map map(4);
+  map.assign(doc.data(), doc.data() + doc.size());
+  assert(map.is_valid(), "position_map valid");
+  check_position_map(map, doc, "position_map assign");
+  {
+    utf8::position_map::line_column lc = { 1, 100 };
+    assert(map.to_octet(doc.data(), lc) == 2 * 24 - 1, "position_map clamp column");
+  }
+  // insert two lines in the middle
+  const std::vector<uint8_t> inserted = { 0x0a, 0x41, 0xd0, 0x97, 0x0a, 0x42 };
+  doc.insert(doc.begin() + 30, inserted.begin(), inserted.end());
+  map.replace(doc.data(), doc.data() + doc.size(), 30, 0, inserted.size());
+  check_position_map(map, doc, "position_map insert");
+  // remove a range spanning several lines and checkpoints
+  doc.erase(doc.begin() + 18, doc.begin() + 78);
+  map.replace(doc.data(), doc.data() + doc.size(), 18, 60, 0);
+  check_position_map(map, doc, "position_map erase");
+  // break a sequence, then repair it
+  const uint8_t saved = doc[45];
+  doc[45] = 0x41;
+  map.replace(doc.data(), doc.data() + doc.size(), 45, 1, 1);
+  check_position_map(map, doc, "position_map invalid");
+  assert(!map.is_valid(), "position_map invalid 2");
+  doc[45] = saved;
+  map.replace(doc.data(), doc.data() + doc.size(), 45, 1, 1);
+  check_position_map(map, doc, "position_map repaired");
+  assert(map.is_valid(), "position_map repaired 2");
+  // append at the end
+  doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+  map.replace(doc.data(), doc.data() + doc.size(), doc.size() - hello_bg_utf8.size(), 0, hello_bg_utf8.size());
+  check_position_map(map, doc, "position_map append");
+  // cut a four-octet sequence in half
+  doc.erase(doc.begin() + 39, doc.begin() + 41);
+  map.replace(doc.data(), doc.data() + doc.size(), 39, 2, 0);
+  check_position_map(map, doc, "position_map cut");
+  assert(map.first_invalid() == 37, "position_map cut 2");
+}
+
+static void test_distance() {
+  std::vector<uint8_t> in_buf;
+  for (int i = 0; i < 5; i++) {
+    in_buf.insert(in_buf.end(), 11, 0x61);
+    in_buf.insert(in_buf.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+    in_buf.insert(in_buf.end(), { 0xf0, 0x90, 0x80, 0x80 });
   }
+  const uint8_t *begin = in_buf.data();
+  const uint8_t *end = begin + in_buf.size();
+  const ptrdiff_t expected = 5 * (11 + hello_bg_utf16.size() + 1);
+  assert(utf8::unchecked::distance(begin, end) == expected, "distance unchecked 1");
+  assert(utf8::unchecked::distance(in_buf.begin(), in_buf.end()) == expected, "distance unchecked 2");
+  assert(utf8::distance(begin, end) == expected, "distance checked 1");
+  assert(utf8::distance(begin + 11, begin + 29) == 9, "distance checked 2");
+  assert(utf8::unchecked::distance(end, begin) == 0, "distance unchecked 3");
+  in_buf[40] = 0x80;
+  bool thrown = false;
+  try {
+    utf8::distance(in_buf.data(), in_buf.data() + in_buf.size());
+  } catch (const utf8::invalid_utf8&) {
+    thrown = true;
+  }
+  assert(thrown, "distance checked invalid");
+}
+
+static void test_truncate() {
+  std::vector<uint8_t> in_buf;
+  in_buf.insert(in_buf.end(), 17, 0x61);
+  in_buf.insert(in_buf.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+  in_buf.insert(in_buf.end(), { 0xf0, 0x90, 0x80, 0x80, 0x62 });
+  const uint8_t *begin = in_buf.data();
+  const uint8_t *end = begin + in_buf.size();
+  assert(utf8::truncate(begin, end, 100) == end, "truncate 1");
+  assert(utf8::truncate(begin, end, 17) == begin + 17, "truncate 2");
+  assert(utf8::truncate(begin, end, 18) == begin + 17, "truncate 3");
+  assert(utf8::truncate(begin, end, 37) == begin + 35, "truncate 4");
+  assert(utf8::truncate(begin, end, 39) == begin + 39, "truncate 5");
+  assert(utf8::truncate(begin, end, 0) == begin, "truncate 6");
+  assert(utf8::truncate(std::string("\xd0\x97\xd0\xb4"), 3) == 2, "truncate 7");
+  // 17 ascii + 9 cyrillic units, then a surrogate pair
+  assert(utf8::truncate_to_utf16(begin, end, 100) == end, "truncate_to_utf16 1");
+  assert(utf8::truncate_to_utf16(begin, end, 17) == begin + 17, "truncate_to_utf16 2");
+  assert(utf8::truncate_to_utf16(begin, end, 20) == begin + 23, "truncate_to_utf16 3");
+  assert(utf8::truncate_to_utf16(begin, end, 27) == begin + 35, "truncate_to_utf16 4");
+  assert(utf8::truncate_to_utf16(begin, end, 28) == begin + 39, "truncate_to_utf16 5");
+  assert(utf8::truncate_to_utf16(in_buf.begin(), in_buf.end(), 20) == in_buf.begin() + 23, "truncate_to_utf16 6");
+  assert(utf8::truncate16(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), 1) == valid_utf16_surrogate.begin(), "truncate16 1");
+  assert(utf8::truncate16(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), 2) == valid_utf16_surrogate.end(), "truncate16 2");
+  assert(utf8::truncate16(hello_bg_utf16.begin(), hello_bg_utf16.end(), 4) == hello_bg_utf16.begin() + 4, "truncate16 3");
+}
+
+static void test_utf32_lenient() {
+  const std::vector<uint32_t> hello_bg_utf32(hello_bg_utf16.begin(), hello_bg_utf16.end());
   {
-    const uint16_t *ptr = nullptr;
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    auto res = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
-    assert(ptr != nullptr, "hello invalid_utf16_surrogate 1");
-    assert((ptr - in_buf.data()) == 10, "hello invalid_utf16_surrogate 2");
-    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "hello invalid_utf16_surrogate 3");
-    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin() + 24), "hello invalid_utf16_surrogate 4");
-    assert(res[hello_bg_utf8.size() + 0] == 0xef, "hello invalid_utf16_surrogate 5");
-    assert(res[hello_bg_utf8.size() + 1] == 0xbf, "hello invalid_utf16_surrogate 6");
-    assert(res[hello_bg_utf8.size() + 2] == 0xbd, "hello invalid_utf16_surrogate 7");
-    assert(res[hello_bg_utf8.size() + 3] == 0xef, "hello invalid_utf16_surrogate 8");
-    assert(res[hello_bg_utf8.size() + 4] == 0xbf, "hello invalid_utf16_surrogate 9");
-    assert(res[hello_bg_utf8.size() + 5] == 0xbd, "hello invalid_utf16_surrogate 10");
+    const uint32_t *ptr = hello_bg_utf32.data();
+    auto res = utf32_to_utf8_lenient(hello_bg_utf32.data(), hello_bg_utf32.size(), &ptr);
+    assert(res == hello_bg_utf8, "utf32_to_utf8 1");
+    assert(ptr == nullptr, "utf32_to_utf8 2");
   }
   {
-    const uint16_t *ptr = nullptr;
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    auto res = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
-    assert(ptr != nullptr, "hello incomplete_utf16_surrogate 1");
-    assert((ptr - in_buf.data()) == 10, "hello incomplete_utf16_surrogate 2");
-    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "hello incomplete_utf16_surrogate 3");
-    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin() + 21), "hello incomplete_utf16_surrogate 4");
-    assert(res[hello_bg_utf8.size() + 0] == 0xef, "hello incomplete_utf16_surrogate 5");
-    assert(res[hello_bg_utf8.size() + 1] == 0xbf, "hello incomplete_utf16_surrogate 6");
-    assert(res[hello_bg_utf8.size() + 2] == 0xbd, "hello incomplete_utf16_surrogate 7");
+    std::vector<uint32_t> in_buf(hello_bg_utf32);
+    in_buf.insert(in_buf.end(), 20, 0x41);
+    in_buf.insert(in_buf.end(), { 0x10000, 0xd800, 0x110000, 0x42 });
+    const uint32_t *ptr = nullptr;
+    auto res = utf32_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr - in_buf.data() == 30, "utf32_to_utf8 invalid 1");
+    assert(res.size() == hello_bg_utf8.size() + 20 + 4 + 3 + 3 + 1, "utf32_to_utf8 invalid 2");
+    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "utf32_to_utf8 invalid 3");
+    const std::vector<uint8_t> tail = { 0xf0, 0x90, 0x80, 0x80, 0xef, 0xbf, 0xbd, 0xef, 0xbf, 0xbd, 0x42 };
+    assert(std::equal(tail.begin(), tail.end(), res.end() - tail.size()), "utf32_to_utf8 invalid 4");
+
+    auto res16 = utf32_to_utf16_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr - in_buf.data() == 30, "utf32_to_utf16 invalid 1");
+    assert(res16.size() == in_buf.size() + 1, "utf32_to_utf16 invalid 2");
+    const std::vector<uint16_t> tail16 = { 0xd800, 0xdc00, 0xfffd, 0xfffd, 0x42 };
+    assert(std::equal(tail16.begin(), tail16.end(), res16.end() - tail16.size()), "utf32_to_utf16 invalid 3");
   }
   {
-    const uint16_t *ptr = nullptr;
-    std::vector<uint16_t> in_buf;
-    std::back_insert_iterator in_buf_bi = std::back_inserter(in_buf);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    std::copy(valid_utf16_surrogate.begin(), valid_utf16_surrogate.end(), in_buf_bi);
-    std::copy(hello_bg_utf16.begin(), hello_bg_utf16.end(), in_buf_bi);
-    auto res = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
-    assert(ptr == nullptr, "hello valid_utf16_surrogate 1");
-    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin()), "hello valid_utf16_surrogate 3");
-    assert(std::equal(hello_bg_utf8.begin(), hello_bg_utf8.end(), res.begin() + 22), "hello valid_utf16_surrogate 4");
-    assert(res[hello_bg_utf8.size() + 0] == 0xf0, "hello valid_utf16_surrogate 5");
-    assert(res[hello_bg_utf8.size() + 1] == 0x90, "hello valid_utf16_surrogate 6");
-    assert(res[hello_bg_utf8.size() + 2] == 0x80, "hello valid_utf16_surrogate 7");
-    assert(res[hello_bg_utf8.size() + 3] == 0x80, "hello valid_utf16_surrogate 8");
+    const uint8_t *ptr = hello_bg_utf8.data();
+    auto res = utf8_to_utf32_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr);
+    assert(res == hello_bg_utf32, "utf8_to_utf32 1");
+    assert(ptr == nullptr, "utf8_to_utf32 2");
+    res = utf8_to_utf32_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), &ptr);
+    assert(ptr - invalid_utf8_continuation.data() == 1, "utf8_to_utf32 invalid 1");
+    assert(res == std::vector<uint32_t>({ 0x48, invalid_char_replacement, 0x65 }), "utf8_to_utf32 invalid 2");
+  }
+  {
+    const uint16_t *ptr = hello_bg_utf16.data();
+    auto res = utf16_to_utf32_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), &ptr);
+    assert(res == hello_bg_utf32, "utf16_to_utf32 1");
+    assert(ptr == nullptr, "utf16_to_utf32 2");
+    const std::vector<uint16_t> in_buf = { 0xd800, 0xd800, 0xdc00, 0xdc00, 0x41 };
+    res = utf16_to_utf32_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr - in_buf.data() == 1, "utf16_to_utf32 invalid 1");
+    // As in utf16_to_utf8_lenient, the lead surrogate after the replaced one is paired with the next replacement
+    assert(res == std::vector<uint32_t>({ invalid_char_replacement, 0x123fd, invalid_char_replacement, 0x41 }), "utf16_to_utf32 invalid 2");
+  }
+}
+
+static void test_utf16_bytes() {
+  std::vector<uint8_t> hello_le;
+  std::vector<uint8_t> hello_be;
+  for (uint16_t unit : hello_bg_utf16) {
+    hello_le.insert(hello_le.end(), { static_cast<uint8_t>(unit), static_cast<uint8_t>(unit >> 8) });
+    hello_be.insert(hello_be.end(), { static_cast<uint8_t>(unit >> 8), static_cast<uint8_t>(unit) });
+  }
+  {
+    const uint8_t *ptr = hello_le.data();
+    assert(utf16le_to_utf8_lenient(hello_le.data(), hello_le.size(), &ptr) == hello_bg_utf8, "utf16le_to_utf8 1");
+    assert(ptr == nullptr, "utf16le_to_utf8 2");
+    assert(utf16be_to_utf8_lenient(hello_be.data(), hello_be.size(), &ptr) == hello_bg_utf8, "utf16be_to_utf8 1");
+    assert(utf8_to_utf16le_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr) == hello_le, "utf8_to_utf16le 1");
+    assert(utf8_to_utf16be_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr) == hello_be, "utf8_to_utf16be 1");
+    assert(ptr == nullptr, "utf8_to_utf16be 2");
+  }
+  {
+    // ASCII words, a surrogate pair, a lone trail surrogate and an odd trailing octet
+    const std::vector<uint8_t> in_buf = { 0x61, 0, 0x62, 0, 0x63, 0, 0x64, 0, 0x65, 0, 0x00, 0xd8, 0x00, 0xdc, 0x00, 0xdc, 0x66 };
+    const uint8_t *ptr = nullptr;
+    auto res = utf16le_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(ptr - in_buf.data() == 14, "utf16le_to_utf8 invalid 1");
+    const std::vector<uint8_t> expected = { 0x61, 0x62, 0x63, 0x64, 0x65, 0xf0, 0x90, 0x80, 0x80, 0xef, 0xbf, 0xbd, 0xef, 0xbf, 0xbd };
+    assert(res == expected, "utf16le_to_utf8 invalid 2");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    auto res = utf8_to_utf16be_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), &ptr);
+    assert(ptr - invalid_utf8_continuation.data() == 1, "utf8_to_utf16be invalid 1");
+    assert(res == std::vector<uint8_t>({ 0, 0x48, 0xff, 0xfd, 0, 0x65 }), "utf8_to_utf16be invalid 2");
+  }
+  {
+    assert(utf8::detect_bom(utf8::bom16le, utf8::bom16le + 2) == utf8::UTF16LE_BOM, "detect_bom 1");
+    assert(utf8::detect_bom(utf8::bom32le, utf8::bom32le + 4) == utf8::UTF32LE_BOM, "detect_bom 2");
+    assert(utf8::detect_bom(utf8::bom32be, utf8::bom32be + 4) == utf8::UTF32BE_BOM, "detect_bom 3");
+    assert(utf8::detect_bom(std::string("\xef\xbb\xbf")) == utf8::UTF8_BOM, "detect_bom 4");
+    assert(utf8::detect_bom(hello_bg_utf8.begin(), hello_bg_utf8.end()) == utf8::NO_BOM, "detect_bom 5");
+    std::vector<uint8_t> in_buf = { 0xfe, 0xff };
+    in_buf.insert(in_buf.end(), hello_be.begin(), hello_be.end());
+    const uint8_t *ptr = nullptr;
+    assert(bom_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr) == hello_bg_utf8, "bom_to_utf8 1");
+    assert(ptr == nullptr, "bom_to_utf8 2");
+    in_buf = { 0xff, 0xfe, 0, 0, 0x00, 0x00, 0x01, 0x00, 0x00, 0xd8, 0, 0 };
+    assert(bom_to_utf8_lenient(in_buf.data(), in_buf.size(), &ptr) == std::vector<uint8_t>({ 0xf0, 0x90, 0x80, 0x80, 0xef, 0xbf, 0xbd }), "bom_to_utf8 3");
+    assert(ptr - in_buf.data() == 8, "bom_to_utf8 4");
+    assert(bom_to_utf8_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr) == hello_bg_utf8, "bom_to_utf8 5");
+  }
+}
+
+static void test_sniff_encoding() {
+  {
+    const std::string in_buf = "plain ascii text\n";
+    sniff_result res = sniff_encoding(reinterpret_cast<const uint8_t*>(in_buf.data()), in_buf.size());
+    assert(res.encoding == sniffed_encoding::ascii, "sniff ascii 1");
+    assert(res.ascii_only && res.confidence == 100 && res.first_invalid_char == nullptr, "sniff ascii 2");
+  }
+  {
+    sniff_result res = sniff_encoding(hello_bg_utf8.data(), hello_bg_utf8.size());
+    assert(res.encoding == sniffed_encoding::utf8 && !res.ascii_only, "sniff utf8 1");
+    assert(res.confidence == 100 && res.first_invalid_char == nullptr, "sniff utf8 2");
+  }
+  {
+    sniff_result res = sniff_encoding(invalid_utf8_continuation.data(), invalid_utf8_continuation.size());
+    assert(res.encoding == sniffed_encoding::utf8 && res.confidence < 100, "sniff invalid utf8 1");
+    assert(res.first_invalid_char - invalid_utf8_continuation.data() == 1, "sniff invalid utf8 2");
+  }
+  {
+    const std::vector<uint8_t> in_buf = { 0xff, 0xfe, 0x41, 0x00 };
+    sniff_result res = sniff_encoding(in_buf.data(), in_buf.size());
+    assert(res.encoding == sniffed_encoding::utf16le && res.confidence == 100, "sniff utf16le bom");
+  }
+  {
+    const std::string text = "Hello, world";
+    std::vector<uint8_t> in_buf;
+    for (char ch : text) {
+      in_buf.insert(in_buf.end(), { 0, static_cast<uint8_t>(ch) });
+    }
+    sniff_result res = sniff_encoding(in_buf.data(), in_buf.size());
+    assert(res.encoding == sniffed_encoding::utf16be && res.confidence > 50, "sniff utf16be");
+    std::rotate(in_buf.begin(), in_buf.begin() + 1, in_buf.end());
+    res = sniff_encoding(in_buf.data(), in_buf.size());
+    assert(res.encoding == sniffed_encoding::utf16le, "sniff utf16le");
+  }
+  {
+    const std::vector<uint8_t> in_buf = { 0xff, 0xd8, 0xff, 0xe0, 0x00, 0x10, 0x4a, 0x46, 0x49, 0x46, 0x00, 0x01, 0x01, 0x00, 0x00, 0x01 };
+    sniff_result res = sniff_encoding(in_buf.data(), in_buf.size());
+    assert(res.encoding == sniffed_encoding::binary, "sniff binary 1");
+    const std::vector<uint8_t> controls = { 0x7f, 0x45, 0x4c, 0x46, 0x02, 0x01, 0x01, 0x03, 0x04, 0x05 };
+    res = sniff_encoding(controls.data(), controls.size());
+    assert(res.encoding == sniffed_encoding::binary && res.ascii_only, "sniff binary 2");
+    // The decision comes from the sample alone, nothing after it is validated
+    std::vector<uint8_t> long_controls(4 * sniff_sample_len, 0x01);
+    long_controls.push_back(0x80);
+    res = sniff_encoding(long_controls.data(), long_controls.size());
+    assert(res.encoding == sniffed_encoding::binary && !res.ascii_only && res.first_invalid_char == nullptr, "sniff binary 3");
+  }
+}
+
+static void test_error_budget() {
+  const error_budget unlimited = { SIZE_MAX, 0, 0 };
+  {
+    std::vector<uint16_t> out;
+    const uint8_t *ptr = hello_bg_utf8.data();
+    assert(utf8_to_utf16_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), unlimited, out, &ptr) == lenient_status::ok, "budget utf8 ok 1");
+    assert(out == hello_bg_utf16 && ptr == nullptr, "budget utf8 ok 2");
+    assert(utf8_to_utf16_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), unlimited, out, &ptr) == lenient_status::replaced, "budget utf8 replaced 1");
+    assert(out == std::vector<uint16_t>({ 0x48, 0xfffd, 0x65 }), "budget utf8 replaced 2");
+    assert(ptr - invalid_utf8_continuation.data() == 1, "budget utf8 replaced 3");
+  }
+  {
+    // Every other octet is invalid, a budget of 3 stops at the 4th error
+    const std::vector<uint8_t> in_buf = { 0x41, 0xff, 0x42, 0xff, 0x43, 0xff, 0x44, 0xff, 0x45, 0xff };
+    std::vector<uint16_t> out;
+    const uint8_t *ptr = nullptr;
+    const error_budget budget = { 3, 0, 0 };
+    assert(utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), budget, out, &ptr) == lenient_status::too_many_errors, "budget utf8 abort 1");
+    assert(ptr - in_buf.data() == 7, "budget utf8 abort 2");
+    assert(out == std::vector<uint16_t>({ 0x41, 0xfffd, 0x42, 0xfffd, 0x43, 0xfffd, 0x44 }), "budget utf8 abort 3");
+    const error_budget window_budget = { SIZE_MAX, 4, 1 };
+    assert(utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), window_budget, out, &ptr) == lenient_status::too_many_errors, "budget utf8 window 1");
+    assert(ptr - in_buf.data() == 3, "budget utf8 window 2");
+    const error_budget wide_window_budget = { SIZE_MAX, 4, 2 };
+    assert(utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), wide_window_budget, out, &ptr) == lenient_status::replaced, "budget utf8 window 3");
+    assert(out.size() == in_buf.size() && ptr - in_buf.data() == 1, "budget utf8 window 4");
+  }
+  {
+    std::vector<uint8_t> out;
+    const uint16_t *ptr = hello_bg_utf16.data();
+    assert(utf16_to_utf8_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), unlimited, out, &ptr) == lenient_status::ok, "budget utf16 ok 1");
+    assert(out == hello_bg_utf8 && ptr == nullptr, "budget utf16 ok 2");
+    const std::vector<uint16_t> in_buf = { 0x41, 0xdc00, 0x42, 0xd800, 0x43 };
+    const error_budget budget = { 1, 0, 0 };
+    assert(utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), budget, out, &ptr) == lenient_status::too_many_errors, "budget utf16 abort 1");
+    assert(ptr - in_buf.data() == 3, "budget utf16 abort 2");
+    assert(out == std::vector<uint8_t>({ 0x41, 0xef, 0xbf, 0xbd, 0x42 }), "budget utf16 abort 3");
+    const error_budget loose_budget = { 2, 0, 0 };
+    assert(utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), loose_budget, out, &ptr) == lenient_status::replaced, "budget utf16 replaced 1");
+    assert(ptr - in_buf.data() == 2, "budget utf16 replaced 2");
+  }
+  {
+    // An unlimited budget only adds the status to the plain lenient converters
+    const std::vector<std::vector<uint8_t>> inputs8 = {
+      hello_bg_utf8, invalid_utf8_continuation, incomplete_utf8_sequence, invalid_overlong_utf8,
+      { 0x41, 0xe2, 0x82, 0x41, 0xc0, 0x80, 0xf0, 0x9f, 0x98 }, {},
+    };
+    for (const auto &in_buf : inputs8) {
+      std::vector<uint16_t> out;
+      const uint8_t *ptr = nullptr, *expected_ptr = nullptr;
+      const lenient_status status = utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), unlimited, out, &ptr);
+      assert(out == utf8_to_utf16_lenient(in_buf.data(), in_buf.size(), &expected_ptr) && ptr == expected_ptr, "budget utf8 unlimited 1");
+      assert(status == (nullptr == ptr ? lenient_status::ok : lenient_status::replaced), "budget utf8 unlimited 2");
+    }
+    const std::vector<std::vector<uint16_t>> inputs16 = {
+      hello_bg_utf16, invalid_utf16_surrogate, incomplete_utf16_surrogate, valid_utf16_surrogate,
+      { 0x41, 0xdc00, 0x42 }, { 0xd800, 0xd800, 0xdc00 }, { 0xd800, 0x41, 0xd800 }, {},
+    };
+    for (const auto &in_buf : inputs16) {
+      std::vector<uint8_t> out;
+      const uint16_t *ptr = nullptr, *expected_ptr = nullptr;
+      const lenient_status status = utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), unlimited, out, &ptr);
+      assert(out == utf16_to_utf8_lenient(in_buf.data(), in_buf.size(), &expected_ptr) && ptr == expected_ptr, "budget utf16 unlimited 1");
+      assert(status == (nullptr == ptr ? lenient_status::ok : lenient_status::replaced), "budget utf16 unlimited 2");
+    }
+  }
+}
+
+static void test_compact_string() {
+  {
+    // "Grüße, café " followed by a word of ASCII
+    const std::vector<uint8_t> in_buf = { 0x47, 0x72, 0xc3, 0xbc, 0xc3, 0x9f, 0x65, 0x2c, 0x20, 0x63, 0x61, 0x66, 0xc3, 0xa9, 0x20,
+        0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69 };
+    const uint8_t *ptr = in_buf.data();
+    compact_string res = utf8_to_compact_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(res.latin1 && res.utf16_chars.empty() && ptr == nullptr, "compact latin1 1");
+    const std::vector<uint8_t> expected = { 0x47, 0x72, 0xfc, 0xdf, 0x65, 0x2c, 0x20, 0x63, 0x61, 0x66, 0xe9, 0x20,
+        0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69 };
+    assert(res.latin1_chars == expected, "compact latin1 2");
+    assert(latin1_to_utf8(expected.data(), expected.size()) == in_buf, "latin1_to_utf8 1");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    compact_string res = utf8_to_compact_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), &ptr);
+    assert(!res.latin1 && res.utf16_chars == hello_bg_utf16 && ptr == nullptr, "compact utf16 1");
+    const std::vector<uint8_t> in_buf = { 0x41, 0xc3, 0xa9, 0xf0, 0x90, 0x80, 0x80 };
+    res = utf8_to_compact_lenient(in_buf.data(), in_buf.size(), &ptr);
+    assert(!res.latin1 && res.utf16_chars == std::vector<uint16_t>({ 0x41, 0xe9, 0xd800, 0xdc00 }), "compact utf16 2");
+  }
+  {
+    // A replacement does not fit in Latin-1
+    const uint8_t *ptr = nullptr;
+    compact_string res = utf8_to_compact_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), &ptr);
+    assert(!res.latin1 && res.utf16_chars == std::vector<uint16_t>({ 0x48, 0xfffd, 0x65 }), "compact invalid 1");
+    assert(ptr - invalid_utf8_continuation.data() == 1, "compact invalid 2");
+  }
+  {
+    const std::string ascii = "plain ascii only";
+    assert(latin1_to_utf8(reinterpret_cast<const uint8_t*>(ascii.data()), ascii.size()) ==
+        std::vector<uint8_t>(ascii.begin(), ascii.end()), "latin1_to_utf8 2");
+  }
+}
+
+static std::vector<uint8_t> to_bytes(const std::string &str) {
+  return std::vector<uint8_t>(str.begin(), str.end());
+}
+
+static void test_json_escape() {
+  {
+    const std::vector<uint8_t> in_buf = to_bytes("a plain ascii span, then \"quoted\" \\ tab\t nl\n bell\x07 end");
+    const uint8_t *ptr = in_buf.data();
+    auto res = utf8_to_json_lenient(in_buf.data(), in_buf.size(), false, &ptr);
+    assert(res == to_bytes("a plain ascii span, then \\\"quoted\\\" \\\\ tab\\t nl\\n bell\\u0007 end"), "json ascii 1");
+    assert(ptr == nullptr, "json ascii 2");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    assert(utf8_to_json_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), false, &ptr) == hello_bg_utf8, "json utf8 raw");
+    const std::vector<uint8_t> in_buf = { 0x41, 0xc3, 0xa9, 0xf0, 0x9f, 0x98, 0x80 };
+    assert(utf8_to_json_lenient(in_buf.data(), in_buf.size(), true, &ptr) == to_bytes("A\\u00e9\\ud83d\\ude00"), "json utf8 escaped");
+  }
+  {
+    const uint8_t *ptr = nullptr;
+    auto res = utf8_to_json_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), false, &ptr);
+    assert(res == std::vector<uint8_t>({ 0x48, 0xef, 0xbf, 0xbd, 0x65 }), "json invalid 1");
+    assert(ptr - invalid_utf8_continuation.data() == 1, "json invalid 2");
+    res = utf8_to_json_lenient(incomplete_utf8_sequence.data(), incomplete_utf8_sequence.size(), true, &ptr);
+    assert(res == to_bytes("\\ufffd"), "json invalid 3");
+  }
+}
+
+static void test_percent_decode() {
+  {
+    const std::vector<uint8_t> in_buf = to_bytes("/path/with%20escapes/%D0%97%d0%b4%D1%80/and%zz/100%");
+    const uint8_t *ptr = in_buf.data();
+    auto res = percent_decode_lenient(in_buf.data(), in_buf.size(), true, &ptr);
+    assert(res == to_bytes("/path/with escapes/\xd0\x97\xd0\xb4\xd1\x80/and%zz/100%"), "percent valid 1");
+    assert(ptr == nullptr, "percent valid 2");
+  }
+  {
+    // An escaped lead octet followed by a literal ASCII octet, stray escaped continuation octets and a cut sequence
+    const std::vector<uint8_t> in_buf = to_bytes("a%D0b%80%80c%E0%A0");
+    const uint8_t *ptr = nullptr;
+    auto res = percent_decode_lenient(in_buf.data(), in_buf.size(), true, &ptr);
+    assert(res == to_bytes("a\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd" "c\xef\xbf\xbd"), "percent invalid 1");
+    assert(ptr - in_buf.data() == 1, "percent invalid 2");
+    res = percent_decode_lenient(in_buf.data(), in_buf.size(), false, &ptr);
+    assert(res == to_bytes("a\xd0" "b\x80\x80" "c\xe0\xa0"), "percent invalid 3");
+    assert(ptr - in_buf.data() == 1, "percent invalid 4");
+  }
+  {
+    const std::vector<uint8_t> in_buf = to_bytes("ok%F0%9F%98%80%C0%AF");
+    const uint8_t *ptr = nullptr;
+    auto res = percent_decode_lenient(in_buf.data(), in_buf.size(), true, &ptr);
+    assert(res == to_bytes("ok\xf0\x9f\x98\x80\xef\xbf\xbd"), "percent overlong 1");
+    assert(ptr - in_buf.data() == 14, "percent overlong 2");
+  }
+}
+
+static void test_compare_lenient() {
+  const std::vector<uint32_t> hello_bg_utf32 = { 0x0417, 0x0434, 0x0440, 0x0430, 0x0432, 0x0435, 0x0439, 0x0442, 0x0435 };
+  assert(equal_lenient(hello_bg_utf8.data(), hello_bg_utf8.size(), hello_bg_utf16.data(), hello_bg_utf16.size()), "equal utf8 utf16");
+  assert(equal_lenient(hello_bg_utf32.data(), hello_bg_utf32.size(), hello_bg_utf8.data(), hello_bg_utf8.size()), "equal utf32 utf8");
+  assert(hash_lenient(hello_bg_utf8.data(), hello_bg_utf8.size()) == hash_lenient(hello_bg_utf16.data(), hello_bg_utf16.size()), "hash utf8 utf16");
+  assert(hash_lenient(hello_bg_utf32.data(), hello_bg_utf32.size()) == hash_lenient(hello_bg_utf16.data(), hello_bg_utf16.size()), "hash utf32 utf16");
+  assert(hash_lenient(hello_bg_utf8.data(), hello_bg_utf8.size() - 2) != hash_lenient(hello_bg_utf16.data(), hello_bg_utf16.size()), "hash prefix");
+  {
+    // Longer than a comparison block, with a difference near the end
+    std::string text(200, 'x');
+    std::vector<uint16_t> text16(text.begin(), text.end());
+    const std::vector<uint8_t> text8 = to_bytes(text);
+    assert(compare_lenient(text8.data(), text8.size(), text16.data(), text16.size()) == 0, "compare long 1");
+    text16[190] = 0x0430;
+    assert(compare_lenient(text8.data(), text8.size(), text16.data(), text16.size()) < 0, "compare long 2");
+    assert(compare_lenient(text16.data(), text16.size(), text8.data(), text8.size()) > 0, "compare long 3");
+    assert(compare_lenient(text8.data(), text8.size() - 1, text8.data(), text8.size()) < 0, "compare long 4");
+    assert(hash_lenient(text8.data(), text8.size()) != hash_lenient(text16.data(), text16.size()), "hash long");
+  }
+  {
+    // Code point order differs from UTF-16 code unit order above the surrogates
+    const std::vector<uint8_t> replacement = { 0xef, 0xbf, 0xbd };
+    assert(compare_lenient(replacement.data(), replacement.size(), valid_utf16_surrogate.data(), valid_utf16_surrogate.size()) < 0, "compare supplementary");
+    // Invalid input compares like its lenient conversion
+    assert(equal_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(),
+        std::vector<uint16_t>({ 0x48, 0xfffd, 0x65 }).data(), 3), "compare invalid");
+  }
+}
+
+static void test_nothrow() {
+  {
+    std::vector<uint16_t> out;
+    auto res = utf8::nothrow::utf8to16(hello_bg_utf8.begin(), hello_bg_utf8.end(), std::back_inserter(out));
+    assert(res.ok() && res.offset == hello_bg_utf8.size() && out == hello_bg_utf16, "nothrow utf8to16 1");
+    out.clear();
+    res = utf8::nothrow::utf8to16(invalid_utf8_continuation.begin(), invalid_utf8_continuation.end(), std::back_inserter(out));
+    assert(res.error == utf8::nothrow::INVALID_LEAD && res.offset == 1 && out.size() == 1, "nothrow utf8to16 2");
+    res = utf8::nothrow::utf8to16(incomplete_utf8_sequence.begin(), incomplete_utf8_sequence.end(), std::back_inserter(out));
+    assert(res.error == utf8::nothrow::NOT_ENOUGH_ROOM && res.offset == 0, "nothrow utf8to16 3");
+  }
+  {
+    std::vector<uint32_t> out;
+    auto res = utf8::nothrow::utf8to32(invalid_overlong_utf8.begin(), invalid_overlong_utf8.end(), std::back_inserter(out));
+    assert(res.error == utf8::nothrow::INVALID_CODE_POINT && out.empty(), "nothrow utf8to32 1");
+    std::vector<uint8_t> out8;
+    const std::vector<uint32_t> in32 = { 0x41, 0x110000 };
+    auto res8 = utf8::nothrow::utf32to8(in32.begin(), in32.end(), std::back_inserter(out8));
+    assert(res8.error == utf8::nothrow::INVALID_CODE_POINT && res8.offset == 1 && out8 == std::vector<uint8_t>({ 0x41 }), "nothrow utf32to8 1");
+  }
+  {
+    std::vector<uint8_t> out;
+    auto res = utf8::nothrow::utf16to8(hello_bg_utf16.begin(), hello_bg_utf16.end(), std::back_inserter(out));
+    assert(res.ok() && out == hello_bg_utf8, "nothrow utf16to8 1");
+    res = utf8::nothrow::utf16to8(invalid_utf16_surrogate.begin(), invalid_utf16_surrogate.end(), std::back_inserter(out));
+    assert(res.error == utf8::nothrow::INVALID_LEAD && res.offset == 0, "nothrow utf16to8 2");
+    res = utf8::nothrow::utf16to8(incomplete_utf16_surrogate.begin(), incomplete_utf16_surrogate.end(), std::back_inserter(out));
+    assert(res.error == utf8::nothrow::NOT_ENOUGH_ROOM, "nothrow utf16to8 3");
+    const std::vector<uint16_t> unpaired = { 0x41, 0xd800, 0x42 };
+    res = utf8::nothrow::utf16to8(unpaired.begin(), unpaired.end(), std::back_inserter(out));
+    assert(res.error == utf8::nothrow::INCOMPLETE_SEQUENCE && res.offset == 1, "nothrow utf16to8 4");
+  }
+  {
+    const uint8_t *it = invalid_utf8_continuation.data();
+    const uint8_t *end = it + invalid_utf8_continuation.size();
+    assert(utf8::nothrow::next(it, end).value == 0x48, "nothrow next 1");
+    assert(utf8::nothrow::next(it, end).error == utf8::nothrow::INVALID_LEAD && it == end - 2, "nothrow next 2");
+    const uint16_t *it16 = incomplete_utf16_surrogate.data();
+    assert(utf8::nothrow::next16(it16, it16 + 1).error == utf8::nothrow::NOT_ENOUGH_ROOM, "nothrow next16");
+  }
+  {
+    // offset is how far the iterator moved: the sequence length, or 0 on error
+    const std::vector<uint8_t> doc = { 0x41, 0xd0, 0x97, 0xe2, 0x82, 0xac, 0xf0, 0x9f, 0x98, 0x80, 0xe2, 0x82 };
+    const uint8_t *it = doc.data();
+    const uint8_t *end = it + doc.size();
+    for (size_t expected : { 1, 2, 3, 4 }) {
+      const uint8_t *sequence_start = it;
+      auto res = utf8::nothrow::next(it, end);
+      assert(res.ok() && res.offset == expected && it == sequence_start + expected, "nothrow next offset 1");
+    }
+    auto res = utf8::nothrow::next(it, end);
+    assert(res.error == utf8::nothrow::NOT_ENOUGH_ROOM && res.offset == 0 && it == end - 2, "nothrow next offset 2");
+    std::list<uint8_t> lst(doc.begin() + 6, doc.begin() + 10);
+    std::list<uint8_t>::iterator lst_it = lst.begin();
+    assert(utf8::nothrow::next(lst_it, lst.end()).offset == 4 && lst_it == lst.end(), "nothrow next offset list");
+    const std::vector<uint16_t> units = { 0x41, 0xd83d, 0xde00, 0xdc00, 0x42 };
+    const uint16_t *it16 = units.data();
+    const uint16_t *end16 = it16 + units.size();
+    assert(utf8::nothrow::next16(it16, end16).offset == 1, "nothrow next16 offset 1");
+    auto res16 = utf8::nothrow::next16(it16, end16);
+    assert(res16.ok() && res16.offset == 2 && res16.value == 0x1f600 && it16 == end16 - 2, "nothrow next16 offset 2");
+    res16 = utf8::nothrow::next16(it16, end16);
+    assert(res16.error == utf8::nothrow::INVALID_LEAD && res16.offset == 0 && it16 == end16 - 2, "nothrow next16 offset 3");
+  }
+  {
+    std::vector<uint8_t> out(4);
+    assert(utf8::nothrow::append(0xd800, out.begin()).error == utf8::internal::INVALID_CODE_POINT, "nothrow append 1");
+    assert(utf8::nothrow::append(0x10000, out.begin()).value == out.end(), "nothrow append 2");
+  }
+}
+
+static void test_checked_bulk() {
+  std::vector<uint8_t> doc = to_bytes("a run of ascii text before ");
+  doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+  doc.insert(doc.end(), { 0xf0, 0x9f, 0x98, 0x80 });
+  std::vector<uint16_t> expected16;
+  utf8::unchecked::utf8to16(doc.begin(), doc.end(), std::back_inserter(expected16));
+  std::vector<uint32_t> expected32;
+  utf8::unchecked::utf8to32(doc.begin(), doc.end(), std::back_inserter(expected32));
+  {
+    std::vector<uint16_t> out;
+    utf8::utf8to16(doc.data(), doc.data() + doc.size(), std::back_inserter(out));
+    assert(out == expected16, "checked bulk utf8to16 1");
+    std::vector<uint32_t> out32;
+    utf8::utf8to32(doc.data(), doc.data() + doc.size(), std::back_inserter(out32));
+    assert(out32 == expected32, "checked bulk utf8to32 1");
+  }
+  {
+    // The valid prefix is written before the exception, as with the per-code-point loop
+    doc.insert(doc.begin() + 29, 0x80);
+    std::vector<uint16_t> out;
+    bool thrown = false;
+    try {
+      utf8::utf8to16(doc.data(), doc.data() + doc.size(), std::back_inserter(out));
+    } catch (const utf8::invalid_utf8 &e) {
+      thrown = e.utf8_octet() == 0x80;
+    }
+    assert(thrown && out.size() == 28, "checked bulk utf8to16 2");
+    std::vector<uint32_t> out32;
+    thrown = false;
+    try {
+      utf8::utf8to32(doc.data(), doc.data() + doc.size() - 3, std::back_inserter(out32));
+    } catch (const utf8::invalid_utf8 &) {
+      thrown = true;
+    }
+    assert(thrown && out32.size() == 28, "checked bulk utf8to32 2");
+    doc.erase(doc.begin() + 29);
+    thrown = false;
+    try {
+      utf8::utf8to32(doc.data(), doc.data() + doc.size() - 1, std::back_inserter(out32));
+    } catch (const utf8::not_enough_room &) {
+      thrown = true;
+    }
+    assert(thrown, "checked bulk utf8to32 3");
+  }
+}
+
+static void test_lenient_allocator() {
+  // Everything, including the replacement temporaries, comes from the arena
+  char buf[4096];
+  std::pmr::monotonic_buffer_resource arena(buf, sizeof(buf), std::pmr::null_memory_resource());
+  std::pmr::polymorphic_allocator<uint8_t> alloc(&arena);
+  const uint8_t *ptr = nullptr;
+  auto res16 = utf8_to_utf16_lenient(invalid_utf8_continuation.data(), invalid_utf8_continuation.size(), &ptr, alloc);
+  assert(res16.get_allocator().resource() == &arena, "lenient allocator 1");
+  assert(res16 == std::pmr::vector<uint16_t>({ 0x48, 0xfffd, 0x65 }) && ptr - invalid_utf8_continuation.data() == 1, "lenient allocator 2");
+  const uint16_t *ptr16 = nullptr;
+  auto res8 = utf16_to_utf8_lenient(invalid_utf16_surrogate.data(), invalid_utf16_surrogate.size(), &ptr16, alloc);
+  assert(res8.get_allocator().resource() == &arena && res8.size() == 6, "lenient allocator 3");
+  res8 = utf16_to_utf8_lenient(hello_bg_utf16.data(), hello_bg_utf16.size(), &ptr16, alloc);
+  assert(std::equal(res8.begin(), res8.end(), hello_bg_utf8.begin(), hello_bg_utf8.end()), "lenient allocator 4");
+}
+
+static void test_lenient_strings() {
+  const std::string hello(hello_bg_utf8.begin(), hello_bg_utf8.end());
+  const std::u16string hello16(hello_bg_utf16.begin(), hello_bg_utf16.end());
+  size_t pos = 0;
+  assert(utf8_to_utf16_lenient("ascii " + hello, &pos) == u"ascii " + hello16 && pos == std::string::npos, "lenient strings utf8to16 1");
+  assert(utf8_to_utf16_lenient(std::string("H\x80" "e\xf0\x9f\x98\x80"), &pos) == u"H\ufffde\U0001f600", "lenient strings utf8to16 2");
+  assert(pos == 1, "lenient strings utf8to16 3");
+  assert(utf16_to_utf8_lenient(hello16, &pos) == hello && pos == std::string::npos, "lenient strings utf16to8 1");
+  assert(utf16_to_utf8_lenient(std::u16string({ u'a', 0xdc00, u'b' }), &pos) == "a\xef\xbf\xbd" "b" && pos == 2, "lenient strings utf16to8 2");
+  assert(utf8_to_utf32_lenient(std::string("\xe0\xa0"), &pos) == U"\ufffd" && pos == 0, "lenient strings utf8to32");
+  assert(utf32_to_utf8_lenient(std::u32string({ U'x', 0x110000 }), &pos) == "x\xef\xbf\xbd" && pos == 1, "lenient strings utf32to8");
+  assert(utf8_to_utf16_lenient(std::string(), &pos).empty() && utf16_to_utf8_lenient(std::u16string(), &pos).empty(), "lenient strings empty");
+  {
+    // Results are sized to the exact length, not to the worst case for the input length
+    const std::string ascii(100, 'a');
+    std::string two_octets;
+    for (int i = 0; i < 10; i++) {
+      two_octets += hello + "\x80";
+    }
+    const std::u16string res16 = utf8_to_utf16_lenient(two_octets, &pos);
+    assert(res16.size() == 100 && res16[9] == 0xfffd && pos == 18 && res16.capacity() < 2 * res16.size(), "lenient strings utf8to16 length");
+    const std::u32string res32 = utf8_to_utf32_lenient(two_octets, &pos);
+    assert(res32.size() == 100 && res32[9] == 0xfffd && pos == 18 && res32.capacity() < 2 * res32.size(), "lenient strings utf8to32 length");
+    const std::string res8 = utf16_to_utf8_lenient(std::u16string(ascii.begin(), ascii.end()), &pos);
+    assert(res8 == ascii && res8.capacity() < 2 * res8.size(), "lenient strings utf16to8 length");
+    const std::string res8_32 = utf32_to_utf8_lenient(std::u32string(ascii.begin(), ascii.end()), &pos);
+    assert(res8_32 == ascii && res8_32.capacity() < 2 * res8_32.size(), "lenient strings utf32to8 length");
+  }
+}
+
+static void test_append_outputs() {
+  std::vector<uint8_t> expected;
+  for (uint32_t cp : { 0x41u, 0x417u, 0x20acu, 0x1f600u }) {
+    utf8::append(cp, std::back_inserter(expected));
+  }
+  assert(expected == std::vector<uint8_t>({ 0x41, 0xd0, 0x97, 0xe2, 0x82, 0xac, 0xf0, 0x9f, 0x98, 0x80 }), "append vector");
+  {
+    std::string str;
+    std::list<uint8_t> lst;
+    uint8_t arr[16];
+    uint8_t *arr_end = arr;
+    for (uint32_t cp : { 0x41u, 0x417u, 0x20acu, 0x1f600u }) {
+      utf8::unchecked::append(cp, std::back_inserter(str));
+      utf8::append(cp, std::back_inserter(lst));
+      arr_end = utf8::append(cp, arr_end);
+    }
+    assert(to_bytes(str) == expected, "append string");
+    assert(std::equal(lst.begin(), lst.end(), expected.begin(), expected.end()), "append list");
+    assert(std::equal(arr, arr_end, expected.begin(), expected.end()), "append array");
+  }
+  {
+    uint16_t units[4];
+    uint16_t *units_end = utf8::append16(0x1f600, utf8::append16(0x417, units));
+    assert(units_end - units == 3 && units[0] == 0x417 && units[1] == 0xd83d && units[2] == 0xde00, "append16 array");
+  }
+  {
+    // Loops that own their container append whole sequences to it
+    std::vector<uint8_t> out8;
+    std::string str8;
+    std::vector<uint16_t> out16;
+    std::u16string str16;
+    for (uint32_t cp : { 0x41u, 0x417u, 0x20acu, 0x1f600u }) {
+      utf8::internal::append_back(cp, out8);
+      utf8::internal::append_back(cp, str8);
+      utf8::internal::append16_back(cp, out16);
+      utf8::internal::append16_back(cp, str16);
+    }
+    assert(out8 == expected && to_bytes(str8) == expected, "append_back");
+    assert(out16 == std::vector<uint16_t>({ 0x41, 0x417, 0x20ac, 0xd83d, 0xde00 }) && str16 == u"A\u0417\u20ac\U0001f600", "append16_back");
+    utf8::internal::reserve_back(out8, 100);
+    assert(out8.capacity() >= expected.size() + 100 && out8 == expected, "reserve_back");
+    utf8::internal::copy_span_back(hello_bg_utf8.data(), hello_bg_utf8.data() + hello_bg_utf8.size(), str8);
+    assert(str8.size() == expected.size() + hello_bg_utf8.size() && to_bytes(str8.substr(expected.size())) == hello_bg_utf8, "copy_span_back");
+  }
+  {
+    // The string wrapper of replace_invalid matches the iterator version
+    const std::string in("H\x80" "e\xe2\x82" "llo\xf0\x9f\x98\x80");
+    std::string expected_str;
+    utf8::replace_invalid(in.begin(), in.end(), std::back_inserter(expected_str));
+    assert(utf8::replace_invalid(in) == expected_str, "replace_invalid string 1");
+    expected_str.clear();
+    utf8::replace_invalid(in.begin(), in.end(), std::back_inserter(expected_str), 0x3f);
+    assert(utf8::replace_invalid(in, 0x3f) == expected_str && expected_str == "H?e?llo\xf0\x9f\x98\x80", "replace_invalid string 2");
+    assert(utf8::replace_invalid(std::string("valid"), 0x110000) == "valid", "replace_invalid string 3");
+    bool thrown = false;
+    try {
+      utf8::replace_invalid(in, 0x110000);
+    } catch (const utf8::invalid_code_point &) {
+      thrown = true;
+    }
+    assert(thrown, "replace_invalid string 4");
+  }
+}
+
+static void test_replace_invalid_spans() {
+  // The pointer overloads must match the generic iterator ones on arbitrary input
+  const uint8_t alphabet[] = { 0x41, 0x7f, 0x80, 0xbf, 0xc0, 0xc2, 0xd0, 0xe0, 0xe2, 0xed, 0xa0, 0xf0, 0xf4, 0x90, 0xf5, 0xff };
+  uint32_t seed = 12345;
+  for (int round = 0; round < 2000; round++) {
+    std::vector<uint8_t> in_buf(round % 40);
+    for (uint8_t &octet : in_buf) {
+      seed = seed * 1103515245 + 12345;
+      octet = ((seed >> 16) % 3 == 0) ? static_cast<uint8_t>('a' + (seed >> 20) % 26) : alphabet[(seed >> 20) % sizeof(alphabet)];
+    }
+    const uint8_t *begin = in_buf.data();
+    const uint8_t *end = begin + in_buf.size();
+    std::vector<uint8_t> expected;
+    utf8::replace_invalid(in_buf.begin(), in_buf.end(), std::back_inserter(expected));
+    std::vector<uint8_t> res;
+    utf8::replace_invalid(begin, end, std::back_inserter(res));
+    assert(res == expected, "replace_invalid spans checked");
+    res.clear();
+    utf8::unchecked::replace_invalid(begin, end, std::back_inserter(res));
+    assert(res == expected, "replace_invalid spans unchecked");
+    std::string str;
+    utf8::replace_invalid(begin, end, std::back_inserter(str), 0x3f);
+    std::string str_expected;
+    utf8::replace_invalid(in_buf.begin(), in_buf.end(), std::back_inserter(str_expected), 0x3f);
+    assert(str == str_expected, "replace_invalid spans string");
+  }
+}
+
+static void test_utf8_to_utf32_kernels() {
+  // Words of ASCII, of two-octet sequences, and sequences that fall back to the per-code-point path
+  std::vector<uint8_t> doc = to_bytes("ascii words first, ");
+  for (int i = 0; i < 3; i++) {
+    doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+  }
+  doc.insert(doc.end(), { 0x20, 0xe2, 0x82, 0xac, 0xf0, 0x9f, 0x98, 0x80, 0xc3, 0xa9 });
+  std::vector<uint32_t> expected;
+  for (auto it = doc.begin(); it != doc.end(); ) {
+    expected.push_back(utf8::next(it, doc.end()));
+  }
+  for (size_t offset = 0; offset < 8; offset++) {
+    const uint8_t *begin = doc.data() + offset;
+    const uint8_t *end = doc.data() + doc.size();
+    std::vector<uint32_t> expected_tail;
+    auto tail_it = doc.begin() + offset;
+    while (tail_it != doc.end()) {
+      expected_tail.push_back(utf8::unchecked::next(tail_it));
+    }
+    std::vector<uint32_t> out;
+    utf8::unchecked::utf8to32(begin, end, std::back_inserter(out));
+    assert(offset > 0 || out == expected, "utf8to32 kernel 1");
+    assert(out == expected_tail, "utf8to32 kernel 2");
+    std::vector<uint16_t> out16;
+    utf8::unchecked::utf8to16(begin, end, std::back_inserter(out16));
+    std::vector<uint16_t> expected16;
+    utf8::unchecked::utf8to16(doc.begin() + offset, doc.end(), std::back_inserter(expected16));
+    assert(out16 == expected16, "utf8to16 kernel");
+  }
+  {
+    std::vector<uint32_t> out;
+    utf8::utf8to32(doc.data(), doc.data() + doc.size(), std::back_inserter(out));
+    assert(out.size() == expected.size() && out == expected, "utf8to32 checked exact reserve");
+    const uint8_t *ptr = doc.data();
+    assert(utf8_to_utf32_lenient(doc.data(), doc.size(), &ptr) == expected && ptr == nullptr, "utf8to32 lenient valid");
+  }
+  {
+    std::vector<uint8_t> invalid_doc = doc;
+    invalid_doc.insert(invalid_doc.begin() + 19, { 0xd0, 0x41 });
+    invalid_doc.insert(invalid_doc.end(), { 0xe2, 0x82 });
+    std::vector<uint32_t> lenient_expected = expected;
+    lenient_expected.insert(lenient_expected.begin() + 19, { 0xfffd, 0x41 });
+    lenient_expected.push_back(0xfffd);
+    const uint8_t *ptr = nullptr;
+    auto res = utf8_to_utf32_lenient(invalid_doc.data(), invalid_doc.size(), &ptr);
+    assert(res.size() == lenient_expected.size() && res == lenient_expected, "utf8to32 lenient invalid 1");
+    assert(ptr - invalid_doc.data() == 19, "utf8to32 lenient invalid 2");
+  }
+  {
+    // Mostly garbage: every stray continuation octet is replaced on its own
+    std::vector<uint8_t> garbage(1000, 0x80);
+    garbage[500] = 0x41;
+    garbage.insert(garbage.end(), { 0xc3, 0xa9 });
+    std::vector<uint32_t> garbage_expected(1000, 0xfffd);
+    garbage_expected[500] = 0x41;
+    garbage_expected.push_back(0xe9);
+    const uint8_t *ptr = nullptr;
+    assert(utf8_to_utf32_lenient(garbage.data(), garbage.size(), &ptr) == garbage_expected && ptr == garbage.data(), "utf8to32 lenient garbage");
+  }
+}
+
+static void test_cstring_kernels() {
+  std::string doc = "ascii words first, ";
+  for (int i = 0; i < 3; i++) {
+    doc.append(hello_bg_utf8.begin(), hello_bg_utf8.end());
+  }
+  doc += "\xe2\x82\xac\xf0\x9f\x98\x80 and the tail";
+  // Every alignment of the start and of the terminator
+  for (size_t offset = 0; offset < 8; offset++) {
+    for (size_t len = offset; len <= doc.size(); len++) {
+      std::unique_ptr<char[]> heap(new char[len - offset + 1]);
+      std::copy(doc.begin() + offset, doc.begin() + len, heap.get());
+      heap[len - offset] = '\0';
+      const char *str = heap.get();
+      const char *end = str + (len - offset);
+      size_t length = 0;
+      const size_t invalid = utf8::find_invalid(str, length);
+      const char *expected_invalid = utf8::find_invalid(str, end);
+      assert(length == len - offset, "cstring length");
+      assert(invalid == (expected_invalid == end ? std::string::npos : size_t(expected_invalid - str)), "cstring find_invalid 1");
+      assert(utf8::find_invalid(str) == expected_invalid, "cstring find_invalid 2");
+      assert(utf8::unchecked::distance(str) == utf8::unchecked::distance(str, end), "cstring unchecked distance");
+      if (expected_invalid != end) {
+        continue;
+      }
+      assert(utf8::distance(str) == utf8::distance(str, end), "cstring distance");
+      std::u16string out16, expected16;
+      utf8::utf8to16(str, std::back_inserter(out16));
+      utf8::utf8to16(str, end, std::back_inserter(expected16));
+      assert(out16 == expected16, "cstring utf8to16");
+      std::u32string out32, expected32;
+      utf8::utf8to32(str, std::back_inserter(out32));
+      utf8::utf8to32(str, end, std::back_inserter(expected32));
+      assert(out32 == expected32, "cstring utf8to32");
+    }
+  }
+  {
+    const char truncated[] = "abc\xe2\x82";
+    size_t length = 0;
+    assert(utf8::find_invalid(truncated, length) == 3 && length == 5, "cstring truncated");
+    bool thrown = false;
+    try {
+      std::u32string out;
+      utf8::utf8to32(truncated, std::back_inserter(out));
+    } catch (const utf8::not_enough_room &) {
+      thrown = true;
+    }
+    assert(thrown, "cstring truncated throws not_enough_room");
+  }
+  {
+    const char invalid[] = "abcdefghijk\xe2\x41\x82lmnop";
+    size_t length = 0;
+    assert(utf8::find_invalid(invalid, length) == 11 && length == 19, "cstring invalid");
+    assert(!utf8::is_valid(invalid), "cstring is_valid");
+    bool thrown = false;
+    try {
+      utf8::distance(invalid);
+    } catch (const utf8::invalid_utf8 &e) {
+      thrown = e.utf8_octet() == 0xe2;
+    }
+    assert(thrown, "cstring invalid throws invalid_utf8");
+    assert(utf8::unchecked::distance(invalid) == 18, "cstring unchecked distance invalid");
+  }
+  {
+    // Each error maps to the exception the end pointer version throws, with the same payload
+    const char *const cases[] = { "a\x80", "a\xc0\xaf", "a\xe2z", "a\xed\xa0\x80", "a\xf4\x90\x80\x80", "a\xf0\x9f\x98" };
+    for (const char *str : cases) {
+      const char *end = str + std::char_traits<char>::length(str);
+      std::string cstr_error, range_error;
+      for (int pass = 0; pass < 2; pass++) {
+        std::string &error = (pass == 0) ? cstr_error : range_error;
+        try {
+          std::u32string out;
+          if (pass == 0) {
+            utf8::utf8to32(str, std::back_inserter(out));
+          } else {
+            utf8::utf8to32(str, end, std::back_inserter(out));
+          }
+        } catch (const utf8::invalid_utf8 &e) {
+          error = "invalid_utf8 " + std::to_string(e.utf8_octet());
+        } catch (const utf8::invalid_code_point &e) {
+          error = "invalid_code_point " + std::to_string(e.code_point());
+        } catch (const utf8::not_enough_room &) {
+          error = "not_enough_room";
+        }
+      }
+      assert(!cstr_error.empty() && cstr_error == range_error, "cstring error mapping " + range_error);
+    }
+  }
+}
+
+static void test_backward_scan() {
+  std::vector<uint8_t> doc = to_bytes("ascii words first, ");
+  for (int i = 0; i < 3; i++) {
+    doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+    doc.insert(doc.end(), { 0xe2, 0x82, 0xac, 0xf0, 0x9f, 0x98, 0x80, 0x20 });
+  }
+  std::vector<size_t> boundaries;
+  for (auto it = doc.begin(); it != doc.end(); utf8::next(it, doc.end())) {
+    boundaries.push_back(it - doc.begin());
+  }
+  boundaries.push_back(doc.size());
+  const uint8_t *begin = doc.data();
+  for (size_t b = 0; b < boundaries.size(); b += 3) {
+    for (size_t n = 0; n <= b; n += 5) {
+      const uint8_t *pos = begin + boundaries[b];
+      utf8::advance(pos, -static_cast<int>(n), begin);
+      assert(pos == begin + boundaries[b - n], "advance backward checked");
+      pos = begin + boundaries[b];
+      utf8::unchecked::advance(pos, -static_cast<int>(n));
+      assert(pos == begin + boundaries[b - n], "advance backward unchecked");
+
+      uint32_t out[64], expected[64];
+      auto expected_it = doc.begin() + boundaries[b];
+      const size_t expected_count = utf8::decode_block_backward(expected_it, doc.begin(), expected, n);
+      assert(expected_count == n && expected_it == doc.begin() + boundaries[b - n], "decode_block_backward generic");
+      pos = begin + boundaries[b];
+      assert(utf8::decode_block_backward(pos, begin, out, n) == n, "decode_block_backward checked 1");
+      assert(pos == begin + boundaries[b - n] && std::equal(out, out + n, expected), "decode_block_backward checked 2");
+      pos = begin + boundaries[b];
+      assert(utf8::unchecked::decode_block_backward(pos, out, n) == n, "decode_block_backward unchecked 1");
+      assert(pos == begin + boundaries[b - n] && std::equal(out, out + n, expected), "decode_block_backward unchecked 2");
+    }
+  }
+  {
+    // Fewer code points than requested before the start
+    uint32_t out[64];
+    const uint8_t *pos = begin + boundaries[12];
+    assert(utf8::decode_block_backward(pos, begin, out, 40) == 12 && pos == begin, "decode_block_backward start");
+    assert(out[0] == utf8::peek_next(begin + boundaries[11], begin + doc.size()) && out[11] == 'a', "decode_block_backward start values");
+    bool thrown = false;
+    pos = begin + boundaries[12];
+    try {
+      utf8::advance(pos, -13, begin);
+    } catch (const utf8::not_enough_room &) {
+      thrown = true;
+    }
+    assert(thrown && pos == begin, "advance backward not_enough_room");
+  }
+  {
+    // An invalid sequence stops the bulk path; the valid suffix is still decoded
+    std::vector<uint8_t> invalid_doc = doc;
+    invalid_doc.insert(invalid_doc.begin() + 5, 0xc3);
+    const uint8_t *invalid_begin = invalid_doc.data();
+    const uint8_t *pos = invalid_begin + invalid_doc.size();
+    uint32_t out[128];
+    const size_t count = utf8::decode_block_backward(pos, invalid_begin, out, 128);
+    assert(count == boundaries.size() - 6 && pos == invalid_begin + 6, "decode_block_backward invalid 1");
+    assert(out[count - 1] == ' ', "decode_block_backward invalid 2");
+    // The lead octet in front is cut short by the code point already decoded
+    bool thrown = false;
+    try {
+      utf8::decode_block_backward(pos, invalid_begin, out, 128);
+    } catch (const utf8::not_enough_room &) {
+      thrown = true;
+    }
+    assert(thrown, "decode_block_backward invalid throws");
+    thrown = false;
+    pos = invalid_begin + invalid_doc.size();
+    try {
+      utf8::advance(pos, -static_cast<int>(boundaries.size()), invalid_begin);
+    } catch (const utf8::not_enough_room &) {
+      thrown = true;
+    }
+    assert(thrown && pos == invalid_begin + 5, "advance backward invalid");
+  }
+}
+
+static void test_revalidate() {
+  std::vector<uint8_t> doc = to_bytes("ascii words first, ");
+  for (int i = 0; i < 4; i++) {
+    doc.insert(doc.end(), hello_bg_utf8.begin(), hello_bg_utf8.end());
+    doc.insert(doc.end(), { 0xe2, 0x82, 0xac, 0x0a, 0xf0, 0x9f, 0x98, 0x80, 0x20 });
+  }
+  const auto full_scan = [](const std::vector<uint8_t> &buf) {
+    const uint8_t *invalid = utf8::find_invalid(buf.data(), buf.data() + buf.size());
+    return invalid == buf.data() + buf.size() ? std::string::npos : size_t(invalid - buf.data());
+  };
+  // Edits of a valid document: octets from elsewhere in it, which may cut sequences
+  uint32_t seed = 12345;
+  const auto random = [&seed](size_t n) {
+    seed = seed * 1103515245 + 12345;
+    return static_cast<size_t>((seed >> 8) % n);
+  };
+  for (int i = 0; i < 2000; i++) {
+    const size_t offset = random(doc.size() + 1);
+    const size_t removed = random(std::min<size_t>(doc.size() - offset, 8) + 1);
+    const size_t source = random(doc.size());
+    const size_t inserted = random(std::min<size_t>(doc.size() - source, 8) + 1);
+    std::vector<uint8_t> edited(doc.begin(), doc.begin() + offset);
+    edited.insert(edited.end(), doc.begin() + source, doc.begin() + source + inserted);
+    edited.insert(edited.end(), doc.begin() + offset + removed, doc.end());
+    const size_t invalid = utf8::revalidate(edited.data(), edited.data() + edited.size(), offset, inserted);
+    assert(invalid == full_scan(edited), "revalidate edit");
+  }
+  assert(utf8::revalidate(doc.data(), doc.data() + doc.size(), 0, 0) == std::string::npos, "revalidate empty edit");
+  // The position map follows a document through valid and invalid states
+  std::vector<uint8_t> edited = doc;
+  utf8::position_map map(8);
+  map.assign(edited.data(), edited.data() + edited.size());
+  for (int i = 0; i < 500; i++) {
+    const size_t offset = random(edited.size() + 1);
+    const size_t removed = random(std::min<size_t>(edited.size() - offset, 6) + 1);
+    const size_t source = random(doc.size());
+    const size_t inserted = random(std::min<size_t>(doc.size() - source, 6) + 1);
+    edited.erase(edited.begin() + offset, edited.begin() + offset + removed);
+    edited.insert(edited.begin() + offset, doc.begin() + source, doc.begin() + source + inserted);
+    map.replace(edited.data(), edited.data() + edited.size(), offset, removed, inserted);
+    assert(map.first_invalid() == full_scan(edited), "revalidate position_map");
+  }
+}
+
+static void test_lazy_utf16() {
+  const std::string hello(hello_bg_utf8.begin(), hello_bg_utf8.end());
+  {
+    const lazy_utf16_string str("ascii " + hello + "\xf0\x9f\x98\x80");
+    assert(str.is_valid() && str.first_invalid_pos() == std::string::npos, "lazy utf16 valid");
+    assert(str.code_point_count() == 6 + hello_bg_utf16.size() + 1 && str.utf16_length() == 6 + hello_bg_utf16.size() + 2, "lazy utf16 metadata");
+    assert(!str.has_utf16(), "lazy utf16 not built");
+    size_t pos = 0;
+    const std::u16string &utf16 = str.utf16();
+    assert(str.has_utf16() && utf16 == utf8_to_utf16_lenient(str.utf8_str(), &pos) && utf16.size() == str.utf16_length(), "lazy utf16 built");
+    assert(&str.utf16() == &utf16, "lazy utf16 cached");
+    const lazy_utf16_string copy(str);
+    assert(!copy.has_utf16() && copy.utf16() == utf16 && &copy.utf16() != &utf16, "lazy utf16 copy");
+  }
+  {
+    const std::vector<uint8_t> in = to_bytes("H\x80" "e\xe0\xa0 \xf0\x9f\x98\x80");
+    const lazy_utf16_string str(in.data(), in.size());
+    assert(!str.is_valid() && str.first_invalid_pos() == 1, "lazy utf16 invalid 1");
+    assert(str.code_point_count() == 6 && str.utf16_length() == 7, "lazy utf16 invalid 2");
+    assert(str.utf16() == u"H\ufffde\ufffd \U0001f600", "lazy utf16 invalid 3");
+  }
+  {
+    const lazy_utf16_string empty{std::string()};
+    assert(empty.is_valid() && empty.utf16_length() == 0 && empty.utf16().empty(), "lazy utf16 empty");
+  }
+  {
+    // Concurrent first requests all see the one published string
+    std::string doc;
+    for (int i = 0; i < 200; i++) {
+      doc += hello + " \xe2\x82\xac";
+    }
+    const lazy_utf16_string str(doc);
+    std::vector<const std::u16string*> seen(8, nullptr);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < seen.size(); i++) {
+      threads.emplace_back([&str, &seen, i]() { seen[i] = &str.utf16(); });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    assert(std::count(seen.begin(), seen.end(), &str.utf16()) == 8, "lazy utf16 threads 1");
+    assert(str.utf16().size() == str.utf16_length() && str.code_point_count() == 200 * (hello_bg_utf16.size() + 2), "lazy utf16 threads 2");
   }
 }
 
@@ -389,4 +2802,29 @@ int main() {
   test_utf16_find_invalid();
   test_utf16_replace_invalid();
   test_utf16_to_utf8();
+  test_utf16_recovery();
+  test_decode_block();
+  test_offset_index();
+  test_position_map();
+  test_distance();
+  test_truncate();
+  test_utf32_lenient();
+  test_utf16_bytes();
+  test_sniff_encoding();
+  test_error_budget();
+  test_compact_string();
+  test_json_escape();
+  test_percent_decode();
+  test_compare_lenient();
+  test_nothrow();
+  test_checked_bulk();
+  test_lenient_allocator();
+  test_lenient_strings();
+  test_append_outputs();
+  test_replace_invalid_spans();
+  test_utf8_to_utf32_kernels();
+  test_cstring_kernels();
+  test_backward_scan();
+  test_revalidate();
+  test_lazy_utf16();
 }
\ No newline at end of file
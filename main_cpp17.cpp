@@ -0,0 +1,356 @@
+// Tests of the string, string_view and char8_t interfaces in utf8/cpp11.h, cpp17.h and cpp20.h.
+// main.cpp pins the C++98 interface, so these are built separately as C++17 or C++20:
+//   g++ -std=c++17 -I. main_cpp17.cpp && ./a.out
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "utf8.h"
+
+static void assert(bool check, const std::string &label) {
+  if (!check) {
+    std::cerr << "Assertion failed: " << label << std::endl;
+    std::exit(1);
+  }
+}
+
+// The wrappers size their result once, to the exact length: no worst-case slack is left behind
+static void test_string_wrappers() {
+  const std::string ascii(100, 'a');
+  const std::string cyrillic = "\xd0\x97\xd0\xb4\xd1\x80\xd0\xb0\xd0\xb2\xd0\xb5\xd0\xb9\xd1\x82\xd0\xb5";
+  std::string mixed;
+  for (int i = 0; i < 10; i++) {
+    mixed += cyrillic + " " + "\xf0\x9f\x98\x80";
+  }
+  {
+    const std::u16string res = utf8::utf8to16(mixed);
+    assert(res.size() == 10 * (9 + 1 + 2), "utf8to16 size");
+    assert(res[0] == 0x0417 && res[9] == u' ' && res[10] == 0xd83d && res[11] == 0xde00, "utf8to16 content");
+    assert(res.capacity() < 2 * res.size(), "utf8to16 capacity");
+    assert(utf8::utf16to8(res) == mixed, "utf8to16 round trip");
+  }
+  {
+    std::string two_octets;
+    for (int i = 0; i < 10; i++) {
+      two_octets += cyrillic;
+    }
+    const std::u16string res = utf8::utf8to16(two_octets);
+    assert(res.size() == 90 && res[89] == 0x0435, "utf8to16 two octets");
+    assert(res.capacity() < 2 * res.size(), "utf8to16 two octets capacity");
+  }
+  {
+    const std::u32string res = utf8::utf8to32(mixed);
+    assert(res.size() == 10 * (9 + 1 + 1), "utf8to32 size");
+    assert(res[0] == 0x0417 && res[10] == 0x1f600, "utf8to32 content");
+    assert(res.capacity() < 2 * res.size(), "utf8to32 capacity");
+    assert(utf8::utf32to8(res) == mixed, "utf8to32 round trip");
+  }
+  {
+    const std::string res = utf8::utf16to8(std::u16string(ascii.begin(), ascii.end()));
+    assert(res == ascii, "utf16to8 ascii");
+    assert(res.capacity() < 2 * res.size(), "utf16to8 capacity");
+  }
+  {
+    const std::string res = utf8::utf32to8(std::u32string(ascii.begin(), ascii.end()));
+    assert(res == ascii, "utf32to8 ascii");
+    assert(res.capacity() < 2 * res.size(), "utf32to8 capacity");
+  }
+  {
+    const std::string res = utf8::utf16to8(std::u16string_view(u"\x0417\xd83d\xde00z"));
+    assert(res == "\xd0\x97\xf0\x9f\x98\x80z", "utf16to8 string_view");
+    assert(utf8::utf8to16(std::string_view(res)) == u"\x0417\xd83d\xde00z", "utf8to16 string_view");
+    assert(utf8::utf8to32(std::string_view(res)) == U"\x0417\x1f600z", "utf8to32 string_view");
+  }
+  {
+    assert(utf8::utf8to16(std::string()).empty() && utf8::utf16to8(std::u16string()).empty(), "empty");
+    bool thrown = false;
+    try {
+      utf8::utf8to16(std::string("ab\x80"));
+    } catch (const utf8::invalid_utf8 &) {
+      thrown = true;
+    }
+    assert(thrown, "utf8to16 invalid throws");
+    thrown = false;
+    try {
+      utf8::utf16to8(std::u16string(1, char16_t(0xdc00)));
+    } catch (const utf8::invalid_utf16 &) {
+      thrown = true;
+    }
+    assert(thrown, "utf16to8 invalid throws");
+    thrown = false;
+    try {
+      utf8::utf32to8(std::u32string(1, char32_t(0x110000)));
+    } catch (const utf8::invalid_code_point &) {
+      thrown = true;
+    }
+    assert(thrown, "utf32to8 invalid throws");
+  }
+#if UTF_CPP_CPLUSPLUS >= 202002L
+  {
+    const std::u8string u8s(mixed.begin(), mixed.end());
+    const std::u16string res16 = utf8::utf8to16(u8s);
+    assert(res16 == utf8::utf8to16(mixed), "u8string utf8to16");
+    assert(utf8::utf16tou8(res16) == u8s, "utf16tou8");
+    assert(utf8::utf32tou8(utf8::utf8to32(u8s)) == u8s, "utf32tou8");
+  }
+#endif
+}
+
+// Literal conversion happens at compile time: everything below is checked by the compiler
+namespace literal_checks {
+constexpr auto ascii16 = utf8::utf8to16_literal("abc");
+static_assert(ascii16.size() == 3 && ascii16.view() == u"abc", "ascii literal");
+static_assert(sizeof(ascii16.units) / sizeof(ascii16.units[0]) == 4 + 1, "literal capacity is one unit per octet plus the terminator");
+static_assert(ascii16.c_str()[3] == 0 && ascii16.c_str()[4] == 0, "literal terminator");
+
+// U+00E9 and U+20AC stay single units in UTF-16
+constexpr auto bmp16 = utf8::utf8to16_literal("a\xc3\xa9\xe2\x82\xac");
+constexpr auto bmp32 = utf8::utf8to32_literal("a\xc3\xa9\xe2\x82\xac");
+static_assert(bmp16.size() == 3 && bmp16.units[0] == u'a' && bmp16.units[1] == 0xe9 && bmp16.units[2] == 0x20ac, "bmp literal 16");
+static_assert(bmp32.size() == 3 && bmp32.units[1] == 0xe9 && bmp32.units[2] == 0x20ac && bmp32.units[3] == 0, "bmp literal 32");
+
+// U+1F600 needs a surrogate pair in UTF-16 and a single unit in UTF-32
+constexpr auto supplementary16 = utf8::utf8to16_literal("\xf0\x9f\x98\x80z");
+constexpr auto supplementary32 = utf8::utf8to32_literal("\xf0\x9f\x98\x80z");
+static_assert(supplementary16.size() == 3 && supplementary16.units[0] == 0xd83d && supplementary16.units[1] == 0xde00
+              && supplementary16.units[2] == u'z', "supplementary literal 16");
+static_assert(supplementary32.size() == 2 && supplementary32.units[0] == 0x1f600 && supplementary32.units[1] == U'z',
+              "supplementary literal 32");
+static_assert(supplementary16.view() == std::u16string_view(u"\U0001f600z"), "supplementary literal view");
+
+// Only the terminating zero of the literal is dropped, an embedded NUL is text
+constexpr auto embedded_nul = utf8::utf8to16_literal("a\0\xc3\xa9");
+static_assert(embedded_nul.size() == 3 && embedded_nul.units[0] == u'a' && embedded_nul.units[1] == 0
+              && embedded_nul.units[2] == 0xe9, "embedded NUL literal");
+constexpr auto empty = utf8::utf8to32_literal("");
+static_assert(empty.size() == 0 && empty.view().empty() && empty.c_str()[0] == 0, "empty literal");
+
+#if UTF_CPP_CPLUSPLUS >= 202002L
+constexpr auto char8_16 = utf8::utf8to16_literal(u8"a\u00e9\U0001f600");
+constexpr auto char8_32 = utf8::utf8to32_literal(u8"a\u00e9\U0001f600");
+static_assert(char8_16.size() == 4 && char8_16.view() == u"a\u00e9\U0001f600", "char8_t literal 16");
+static_assert(char8_32.size() == 3 && char8_32.view() == U"a\u00e9\U0001f600", "char8_t literal 32");
+#endif
+
+// The internal decoder and encoders the literals are built on are usable in constant expressions
+constexpr bool validate_next_result(const char *s, std::size_t len, utf8::internal::utf_error expected, utf8::utfchar32_t expected_cp,
+                                    std::size_t expected_len) {
+  const char *it = s;
+  utf8::utfchar32_t cp = 0;
+  const utf8::internal::utf_error err = utf8::internal::validate_next(it, s + len, cp);
+  return err == expected && (err != utf8::internal::UTF8_OK || (cp == expected_cp && static_cast<std::size_t>(it - s) == expected_len));
+}
+static_assert(validate_next_result("z", 1, utf8::internal::UTF8_OK, 0x7a, 1), "validate_next one octet");
+static_assert(validate_next_result("\xe2\x82\xac", 3, utf8::internal::UTF8_OK, 0x20ac, 3), "validate_next three octets");
+static_assert(validate_next_result("\xf0\x9f\x98\x80", 4, utf8::internal::UTF8_OK, 0x1f600, 4), "validate_next four octets");
+static_assert(validate_next_result("\xe2\x82", 2, utf8::internal::NOT_ENOUGH_ROOM, 0, 0), "validate_next truncated");
+static_assert(validate_next_result("\x80", 1, utf8::internal::INVALID_LEAD, 0, 0), "validate_next invalid lead");
+static_assert(validate_next_result("\xe2z", 2, utf8::internal::INCOMPLETE_SEQUENCE, 0, 0), "validate_next incomplete");
+static_assert(validate_next_result("\xc0\xaf", 2, utf8::internal::OVERLONG_SEQUENCE, 0, 0), "validate_next overlong");
+static_assert(validate_next_result("\xed\xa0\x80", 3, utf8::internal::INVALID_CODE_POINT, 0, 0), "validate_next surrogate");
+
+constexpr bool append_result(utf8::utfchar32_t cp, const char *expected, std::size_t expected_len) {
+  char octets[4] = {};
+  const char *octets_end = utf8::internal::append(cp, octets);
+  utf8::utfchar8_t unsigned_octets[4] = {};
+  const utf8::utfchar8_t *unsigned_octets_end = utf8::internal::append(cp, unsigned_octets);
+  if (static_cast<std::size_t>(octets_end - octets) != expected_len || unsigned_octets_end - unsigned_octets != octets_end - octets) {
+    return false;
+  }
+  for (std::size_t i = 0; i < expected_len; i++) {
+    if (octets[i] != expected[i] || unsigned_octets[i] != static_cast<utf8::utfchar8_t>(expected[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+static_assert(append_result(0x41, "A", 1), "append one octet");
+static_assert(append_result(0x417, "\xd0\x97", 2), "append two octets");
+static_assert(append_result(0x20ac, "\xe2\x82\xac", 3), "append three octets");
+static_assert(append_result(0x1f600, "\xf0\x9f\x98\x80", 4), "append four octets");
+
+constexpr bool append16_result(utf8::utfchar32_t cp, utf8::utfchar16_t first, utf8::utfchar16_t second, std::size_t expected_len) {
+  char16_t units[2] = {};
+  const char16_t *units_end = utf8::internal::append16(cp, units);
+  return static_cast<std::size_t>(units_end - units) == expected_len && units[0] == first && units[1] == second;
+}
+static_assert(append16_result(0x20ac, 0x20ac, 0, 1), "append16 bmp");
+static_assert(append16_result(0x1f600, 0xd83d, 0xde00, 2), "append16 supplementary");
+static_assert(append16_result(0x10ffff, 0xdbff, 0xdfff, 2), "append16 last code point");
+} // namespace literal_checks
+
+// The literals are also ordinary objects at run time
+static void test_literals() {
+  static constexpr auto key = utf8::utf8to16_literal("key \xf0\x9f\x98\x80");
+  const std::u16string str(key);
+  assert(str == u"key \U0001f600" && str.size() == key.size(), "literal to string");
+  assert(std::u16string(key.c_str()) == str, "literal c_str");
+  assert(utf8::utf16to8(str) == "key \xf0\x9f\x98\x80", "literal round trip");
+}
+
+// Allocator that counts what it hands out, so that a test can tell where a result's storage came from
+struct allocation_count {
+  size_t allocations = 0;
+  size_t bytes = 0;
+};
+
+template <typename T>
+struct counting_allocator {
+  typedef T value_type;
+  allocation_count *count;
+
+  explicit counting_allocator(allocation_count *c) : count(c) {}
+  template <typename U>
+  counting_allocator(const counting_allocator<U> &other) : count(other.count) {}
+
+  T *allocate(size_t n) {
+    count->allocations++;
+    count->bytes += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+  void deallocate(T *p, size_t n) {
+    std::allocator<T>().deallocate(p, n);
+  }
+  template <typename U>
+  bool operator==(const counting_allocator<U> &other) const {
+    return count == other.count;
+  }
+  template <typename U>
+  bool operator!=(const counting_allocator<U> &other) const {
+    return count != other.count;
+  }
+};
+
+// memory_resource that counts its allocations and takes them from upstream
+class counting_resource : public std::pmr::memory_resource {
+  std::pmr::memory_resource *upstream;
+
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocations++;
+    return upstream->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    upstream->deallocate(p, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+ public:
+  size_t allocations = 0;
+
+  explicit counting_resource(std::pmr::memory_resource *r) : upstream(r) {}
+};
+
+// Results longer than the small string buffer must be allocated with the given allocator or resource
+static void test_allocators() {
+  std::string text;
+  for (int i = 0; i < 8; i++) {
+    text += "words \xd0\x97\xd0\xb4\xd1\x80\xd0\xb0\xd0\xb2\xd0\xb5\xd0\xb9 \xf0\x9f\x98\x80 ";
+  }
+  const std::u16string text16 = utf8::utf8to16(text);
+  const std::u32string text32 = utf8::utf8to32(text);
+  {
+    allocation_count count;
+    const counting_allocator<char> alloc(&count);
+    const auto res16 = utf8::utf8to16(text, alloc);
+    assert(res16.get_allocator().count == &count && count.allocations == 1 && count.bytes >= res16.size() * sizeof(char16_t),
+           "allocator utf8to16");
+    const auto res32 = utf8::utf8to32(text, alloc);
+    assert(res32.get_allocator().count == &count && count.allocations == 2, "allocator utf8to32");
+    const auto res8 = utf8::utf16to8(text16, alloc);
+    assert(res8.get_allocator().count == &count && count.allocations == 3, "allocator utf16to8");
+    const auto res8_32 = utf8::utf32to8(text32, alloc);
+    assert(res8_32.get_allocator().count == &count && count.allocations == 4, "allocator utf32to8");
+    assert(std::u16string(res16.begin(), res16.end()) == text16 && std::u32string(res32.begin(), res32.end()) == text32
+           && std::string_view(res8.data(), res8.size()) == text && std::string_view(res8_32.data(), res8_32.size()) == text,
+           "allocator content");
+    const auto view16 = utf8::utf8to16(std::string_view(text), alloc);
+    const auto replaced = utf8::replace_invalid(std::string_view(text + "\x80"), alloc);
+    assert(view16.get_allocator().count == &count && replaced.get_allocator().count == &count && count.allocations >= 6,
+           "allocator string_view");
+    assert(replaced.size() == text.size() + 3 && replaced.compare(0, text.size(), text.c_str()) == 0, "allocator replace_invalid");
+  }
+  {
+    // Every allocation must come from the given resource: anything taken from the default resource throws
+    counting_resource resource(std::pmr::new_delete_resource());
+    std::pmr::memory_resource *previous = std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    const std::pmr::u16string res16 = utf8::pmr::utf8to16(text, &resource);
+    const std::pmr::u32string res32 = utf8::pmr::utf8to32(text, &resource);
+    const std::pmr::string res8 = utf8::pmr::utf16to8(text16, &resource);
+    const std::pmr::string res8_32 = utf8::pmr::utf32to8(text32, &resource);
+    const std::pmr::string replaced = utf8::pmr::replace_invalid(text + "\x80", &resource);
+    std::pmr::set_default_resource(previous);
+    assert(res16.get_allocator().resource() == &resource && res32.get_allocator().resource() == &resource
+           && res8.get_allocator().resource() == &resource && res8_32.get_allocator().resource() == &resource
+           && replaced.get_allocator().resource() == &resource, "pmr resource");
+    assert(resource.allocations >= 5, "pmr allocations");
+    assert(std::u16string_view(res16) == text16 && std::u32string_view(res32) == text32 && std::string_view(res8) == text
+           && std::string_view(res8_32) == text && replaced.size() == text.size() + 3, "pmr content");
+#if UTF_CPP_CPLUSPLUS >= 202002L
+    const std::u8string u8text(text.begin(), text.end());
+    previous = std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    const std::pmr::u8string res_u8 = utf8::pmr::utf16tou8(text16, &resource);
+    const std::pmr::u16string res16_u8 = utf8::pmr::utf8to16(u8text, &resource);
+    std::pmr::set_default_resource(previous);
+    assert(res_u8.get_allocator().resource() == &resource && std::u8string_view(res_u8) == u8text
+           && std::u16string_view(res16_u8) == text16, "pmr char8_t");
+#endif
+  }
+  {
+    // Invalid input still throws, from the path that fills the result through back_inserter
+    allocation_count count;
+    bool thrown = false;
+    try {
+      utf8::utf8to16(std::string("abc\x80"), counting_allocator<char>(&count));
+    } catch (const utf8::invalid_utf8 &) {
+      thrown = true;
+    }
+    assert(thrown, "allocator invalid throws");
+  }
+  {
+    // A char or int replacement is a code point, not an allocator
+    const std::string s("a\x80" "b");
+    const std::string_view sv(s);
+    assert(utf8::replace_invalid(s, '?') == "a?b" && utf8::replace_invalid(s, 0x3f) == "a?b", "replace_invalid char replacement string");
+    assert(utf8::replace_invalid(sv, '?') == "a?b" && utf8::replace_invalid(sv, 0x3f) == "a?b", "replace_invalid char replacement string_view");
+  }
+}
+
+// The NUL-terminated string entry points, with the C++11 and later overloads in scope
+static void test_cstring() {
+  const char *str = "ascii \xd0\x97\xf0\x9f\x98\x80z";
+  std::vector<char16_t> out16;
+  utf8::utf8to16(str, std::back_inserter(out16));
+  assert(std::u16string(out16.begin(), out16.end()) == u"ascii \u0417\U0001f600z", "cstring utf8to16 back_inserter");
+  char16_t buf16[16];
+  char16_t *end16 = utf8::utf8to16(str, buf16);
+  assert(std::u16string(buf16, end16) == u"ascii \u0417\U0001f600z", "cstring utf8to16 pointer");
+  std::vector<char32_t> out32;
+  utf8::utf8to32(str, std::back_inserter(out32));
+  assert(std::u32string(out32.begin(), out32.end()) == U"ascii \u0417\U0001f600z", "cstring utf8to32 back_inserter");
+  char32_t buf32[16];
+  char32_t *end32 = utf8::utf8to32(str, buf32);
+  assert(std::u32string(buf32, end32) == U"ascii \u0417\U0001f600z", "cstring utf8to32 pointer");
+  assert(utf8::distance(str) == 9 && utf8::unchecked::distance(str) == 9 && utf8::is_valid(str), "cstring distance");
+  size_t length = 0;
+  assert(utf8::find_invalid("ab\x80", length) == 2 && length == 3, "cstring find_invalid");
+  bool thrown = false;
+  try {
+    utf8::utf8to16("ab\x80", buf16);
+  } catch (const utf8::invalid_utf8 &) {
+    thrown = true;
+  }
+  assert(thrown, "cstring invalid throws");
+}
+
+int main() {
+  test_string_wrappers();
+  test_literals();
+  test_allocators();
+  test_cstring();
+}
@@ -42,5 +42,7 @@ If you leave UTF_CPP_CPLUSPLUS undefined, it will be internally assigned to __cp
 
 #include "utf8/checked.h"
 #include "utf8/unchecked.h"
+#include "utf8/index.h"
+#include "utf8/nothrow.h"
 
 #endif // header guard
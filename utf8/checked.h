@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.
 #define UTF8_FOR_CPP_CHECKED_H_2675DCD0_9480_4c0c_B92A_CC14C027B731
 
 #include "core.h"
+#include "unchecked.h"
 #include <stdexcept>
 
 namespace utf8
@@ -126,6 +127,63 @@ namespace utf8
         return out;
     }
 
+    // Contiguous input: clean spans are located with the word-at-a-time find_invalid
+    // and copied in bulk; invalid sequences are replaced exactly as above
+    template <typename octet_type, typename output_iterator>
+    output_iterator replace_invalid(octet_type* start, octet_type* end, output_iterator out, utfchar32_t replacement)
+    {
+        while (start != end) {
+            octet_type* invalid = utf8::find_invalid(start, end);
+            out = std::copy(start, invalid, out);
+            if (invalid == end)
+                break;
+            start = invalid;
+            const internal::utf_error err_code = utf8::internal::validate_next(start, end);
+            out = utf8::append(replacement, out);
+            if (err_code == internal::NOT_ENOUGH_ROOM)
+                start = end;
+            else {
+                ++start;
+                // just one replacement mark for the sequence
+                if (err_code != internal::INVALID_LEAD)
+                    while (start != end && utf8::internal::is_trail(*start))
+                        ++start;
+            }
+        }
+        return out;
+    }
+
+namespace internal
+{
+    // replace_invalid for the string wrappers, which own the result: clean spans and
+    // replacements go in with a single insert each
+    template <typename octet_type, typename string_type>
+    void replace_invalid_into(const octet_type* start, const octet_type* end, string_type& result, utfchar32_t replacement)
+    {
+        utf8::internal::reserve_back(result, static_cast<std::size_t>(end - start));
+        while (start != end) {
+            const octet_type* invalid = utf8::find_invalid(start, end);
+            utf8::internal::copy_span_back(start, invalid, result);
+            if (invalid == end)
+                break;
+            if (!utf8::internal::is_code_point_valid(replacement))
+                throw invalid_code_point(replacement);
+            start = invalid;
+            const internal::utf_error err_code = utf8::internal::validate_next(start, end);
+            utf8::internal::append_back(replacement, result);
+            if (err_code == internal::NOT_ENOUGH_ROOM)
+                start = end;
+            else {
+                ++start;
+                // just one replacement mark for the sequence
+                if (err_code != internal::INVALID_LEAD)
+                    while (start != end && utf8::internal::is_trail(*start))
+                        ++start;
+            }
+        }
+    }
+} // namespace internal
+
     template <typename octet_iterator, typename output_iterator>
     inline output_iterator replace_invalid(octet_iterator start, octet_iterator end, output_iterator out)
     {
@@ -136,14 +194,14 @@ namespace utf8
     inline std::string replace_invalid(const std::string& s, utfchar32_t replacement)
     {
         std::string result;
-        replace_invalid(s.begin(), s.end(), std::back_inserter(result), replacement);
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, replacement);
         return result;
     }
 
     inline std::string replace_invalid(const std::string& s)
     {
         std::string result;
-        replace_invalid(s.begin(), s.end(), std::back_inserter(result));
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, utfchar32_t(0xfffd));
         return result;
     }
 
@@ -167,6 +225,29 @@ namespace utf8
         return cp;
     }
 
+namespace internal
+{
+    // utf8::next for a NUL-terminated string, with the terminator as the end
+    inline utfchar32_t next_cstr(const char*& it)
+    {
+        utfchar32_t cp = 0;
+        const internal::utf_error err_code = utf8::internal::validate_next_cstr(it, cp);
+        switch (err_code) {
+            case internal::UTF8_OK :
+                break;
+            case internal::NOT_ENOUGH_ROOM :
+                throw not_enough_room();
+            case internal::INVALID_LEAD :
+            case internal::INCOMPLETE_SEQUENCE :
+            case internal::OVERLONG_SEQUENCE :
+                throw invalid_utf8(static_cast<utfchar8_t>(*it));
+            case internal::INVALID_CODE_POINT :
+                throw invalid_code_point(cp);
+        }
+        return cp;
+    }
+} // namespace internal
+
     template <typename word_iterator>
     utfchar32_t next16(word_iterator& it, word_iterator end)
     {
@@ -183,6 +264,28 @@ namespace utf8
         return utf8::next(it, end);
     }
 
+    // Decodes up to n code points into out and advances it past them.
+    // Decoding stops in front of an invalid sequence; the exception is only
+    // thrown if that sequence is the first one, so the valid prefix is never lost.
+    template <typename octet_iterator, typename u32_type>
+    std::size_t decode_block(octet_iterator& it, octet_iterator end, u32_type* out, std::size_t n)
+    {
+        std::size_t count = 0;
+        while (count < n && it != end) {
+            count += utf8::internal::decode_ascii(it, end, out + count, n - count);
+            if (count == n || it == end)
+                break;
+            utfchar32_t cp = 0;
+            if (utf8::internal::validate_next(it, end, cp) != internal::UTF8_OK) {
+                if (count == 0)
+                    utf8::next(it, end);
+                break;
+            }
+            out[count++] = cp;
+        }
+        return count;
+    }
+
     template <typename octet_iterator>
     utfchar32_t prior(octet_iterator& it, octet_iterator start)
     {
@@ -198,6 +301,41 @@ namespace utf8
         return utf8::peek_next(it, end);
     }
 
+    // Decodes up to n code points in front of it, last one first, and moves it back
+    // past them. As with decode_block, decoding stops at an invalid sequence and
+    // the exception is only thrown if that sequence is the first one.
+    template <typename octet_iterator, typename u32_type>
+    std::size_t decode_block_backward(octet_iterator& it, octet_iterator start, u32_type* out, std::size_t n)
+    {
+        std::size_t count = 0;
+        while (count < n && it != start) {
+            utfchar32_t cp = 0;
+            if (utf8::internal::validate_prior(it, start, cp) != internal::UTF8_OK) {
+                if (count == 0)
+                    utf8::prior(it, start);
+                break;
+            }
+            out[count++] = cp;
+        }
+        return count;
+    }
+
+    // Contiguous input: the lead octets are counted back a word at a time, then the
+    // span is validated and decoded forward in bulk. Invalid spans take the path above.
+    template <typename octet_type, typename u32_type>
+    std::size_t decode_block_backward(octet_type*& it, octet_type* start, u32_type* out, std::size_t n)
+    {
+        octet_type* lead = it;
+        const std::size_t count = utf8::internal::retreat_lead_octets(start, lead, n);
+        if (utf8::find_invalid(lead, it) != it)
+            return utf8::decode_block_backward<octet_type*, u32_type>(it, start, out, n);
+        octet_type* temp = lead;
+        utf8::unchecked::decode_block(temp, it, out, count);
+        std::reverse(out, out + count);
+        it = lead;
+        return count;
+    }
+
     template <typename octet_iterator, typename distance_type>
     void advance (octet_iterator& it, distance_type n, octet_iterator end)
     {
@@ -213,6 +351,30 @@ namespace utf8
         }
     }
 
+    // Contiguous input: going backward, the target is found by counting lead octets
+    // a word at a time and the span in between is validated with find_invalid. If it
+    // is invalid, the loop of utf8::prior runs instead and throws where it would have.
+    template <typename octet_type, typename distance_type>
+    void advance (octet_type*& it, distance_type n, octet_type* end)
+    {
+        const distance_type zero(0);
+        if (n < zero) {
+            // backward; end is the start of the range
+            const std::size_t back = static_cast<std::size_t>(zero - n);
+            octet_type* lead = it;
+            if (utf8::internal::retreat_lead_octets(end, lead, back) == back && utf8::find_invalid(lead, it) == it) {
+                it = lead;
+                return;
+            }
+            for (distance_type i = n; i < zero; ++i)
+                utf8::prior(it, end);
+        } else {
+            // forward
+            for (distance_type i = zero; i < n; ++i)
+                utf8::next(it, end);
+        }
+    }
+
     template <typename octet_iterator>
     typename std::iterator_traits<octet_iterator>::difference_type
     distance (octet_iterator first, octet_iterator last)
@@ -223,6 +385,41 @@ namespace utf8
         return dist;
     }
 
+    // Contiguous input: ASCII runs are counted a word at a time, only the
+    // multi-octet sequences go through the validating utf8::next
+    template <typename octet_type>
+    std::ptrdiff_t distance (octet_type* first, octet_type* last)
+    {
+        std::ptrdiff_t dist = 0;
+        while (first < last) {
+            octet_type* ascii_end = utf8::internal::skip_ascii(first, last);
+            dist += ascii_end - first;
+            first = ascii_end;
+            if (first == last)
+                break;
+            utf8::next(first, last);
+            ++dist;
+        }
+        return dist;
+    }
+
+    // NUL-terminated input: the terminator is found in the same pass that validates,
+    // so there is no strlen first. A sequence cut short by the terminator throws
+    // not_enough_room, as it would with an end pointer at the terminator.
+    inline std::ptrdiff_t distance (const char* str)
+    {
+        std::ptrdiff_t dist = 0;
+        for (;;) {
+            const char* ascii_end = utf8::internal::skip_ascii_cstr(str);
+            dist += ascii_end - str;
+            str = ascii_end;
+            if (*str == '\0')
+                return dist;
+            utf8::internal::next_cstr(str);
+            ++dist;
+        }
+    }
+
     template <typename u16bit_iterator, typename octet_iterator>
     octet_iterator utf16to8 (u16bit_iterator start, u16bit_iterator end, octet_iterator result)
     {
@@ -265,6 +462,39 @@ namespace utf8
         return result;
     }
 
+    // Contiguous input: the range is validated up front and converted without
+    // per-code-point checks; utf8::next only runs on the invalid sequence, to throw
+    template <typename u16bit_iterator, typename octet_type>
+    u16bit_iterator utf8to16 (octet_type* start, octet_type* end, u16bit_iterator result)
+    {
+        if (!(start < end))
+            return result;
+        octet_type* invalid = utf8::find_invalid(start, end);
+        result = utf8::unchecked::utf8to16(start, invalid, result);
+        if (invalid != end)
+            utf8::next(invalid, end);
+        return result;
+    }
+
+    // NUL-terminated input, decoded in the pass that validates and finds the terminator
+    template <typename u16bit_iterator>
+    u16bit_iterator utf8to16 (const char* str, u16bit_iterator result)
+    {
+        for (;;) {
+            for (const char* ascii_end = utf8::internal::skip_ascii_cstr(str); str != ascii_end; ++str)
+                *result++ = static_cast<utfchar16_t>(*str);
+            if (*str == '\0')
+                return result;
+            const utfchar32_t cp = utf8::internal::next_cstr(str);
+            if (cp > 0xffff) { //make a surrogate pair
+                *result++ = static_cast<utfchar16_t>((cp >> 10)   + internal::LEAD_OFFSET);
+                *result++ = static_cast<utfchar16_t>((cp & 0x3ff) + internal::TRAIL_SURROGATE_MIN);
+            }
+            else
+                *result++ = static_cast<utfchar16_t>(cp);
+        }
+    }
+
     template <typename octet_iterator, typename u32bit_iterator>
     octet_iterator utf32to8 (u32bit_iterator start, u32bit_iterator end, octet_iterator result)
     {
@@ -283,6 +513,31 @@ namespace utf8
         return result;
     }
 
+    template <typename octet_type, typename u32bit_iterator>
+    u32bit_iterator utf8to32 (octet_type* start, octet_type* end, u32bit_iterator result)
+    {
+        if (!(start < end))
+            return result;
+        octet_type* invalid = utf8::find_invalid(start, end);
+        result = utf8::unchecked::utf8to32(start, invalid, result);
+        if (invalid != end)
+            utf8::next(invalid, end);
+        return result;
+    }
+
+    // NUL-terminated input, decoded in the pass that validates and finds the terminator
+    template <typename u32bit_iterator>
+    u32bit_iterator utf8to32 (const char* str, u32bit_iterator result)
+    {
+        for (;;) {
+            for (const char* ascii_end = utf8::internal::skip_ascii_cstr(str); str != ascii_end; ++str)
+                (*result++) = static_cast<utfchar32_t>(*str);
+            if (*str == '\0')
+                return result;
+            (*result++) = utf8::internal::next_cstr(str);
+        }
+    }
+
     // The iterator class
     template <typename octet_iterator>
     class iterator {
@@ -28,6 +28,7 @@ DEALINGS IN THE SOFTWARE.
 #ifndef UTF8_FOR_CPP_CORE_H_2675DCD0_9480_4c0c_B92A_CC14C027B731
 #define UTF8_FOR_CPP_CORE_H_2675DCD0_9480_4c0c_B92A_CC14C027B731
 
+#include <algorithm>
 #include <iterator>
 #include <cstring>
 #include <string>
@@ -48,6 +49,29 @@ DEALINGS IN THE SOFTWARE.
     #define UTF_CPP_NOEXCEPT throw()
 #endif // C++ 11 or later
 
+#if UTF_CPP_CPLUSPLUS >= 201402L // C++ 14 or later
+    #define UTF_CPP_CONSTEXPR14 constexpr
+#else // C++ 98/03/11
+    #define UTF_CPP_CONSTEXPR14
+#endif // C++ 14 or later
+
+// NOTE: the NUL-terminated string kernels (skip_ascii_cstr, count_lead_octets_cstr)
+// read whole aligned words, so they may read up to WORD_SIZE - 1 octets past the
+// terminator. An aligned word never straddles a page boundary, so the read cannot
+// fault, but it does touch memory outside of the string, which AddressSanitizer,
+// MemorySanitizer and Valgrind report. Under AddressSanitizer or MemorySanitizer,
+// or when UTF_CPP_CSTR_SCALAR is defined, the kernels read one octet at a time and
+// never go past the terminator.
+#if !defined(UTF_CPP_CSTR_SCALAR)
+    #if defined(__SANITIZE_ADDRESS__)
+        #define UTF_CPP_CSTR_SCALAR
+    #elif defined(__has_feature)
+        #if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+            #define UTF_CPP_CSTR_SCALAR
+        #endif
+    #endif
+#endif // !UTF_CPP_CSTR_SCALAR
+
 
 namespace utf8
 {
@@ -83,49 +107,49 @@ namespace internal
     const utfchar32_t CODE_POINT_MAX      = 0x0010ffffu;
 
     template<typename octet_type>
-    inline utfchar8_t mask8(octet_type oc)
+    inline UTF_CPP_CONSTEXPR14 utfchar8_t mask8(octet_type oc)
     {
         return static_cast<utfchar8_t>(0xff & oc);
     }
     template<typename u16_type>
-    inline utfchar16_t mask16(u16_type oc)
+    inline UTF_CPP_CONSTEXPR14 utfchar16_t mask16(u16_type oc)
     {
         return static_cast<utfchar16_t>(0xffff & oc);
     }
 
     template<typename octet_type>
-    inline bool is_trail(octet_type oc)
+    inline UTF_CPP_CONSTEXPR14 bool is_trail(octet_type oc)
     {
         return ((utf8::internal::mask8(oc) >> 6) == 0x2);
     }
 
-    inline bool is_lead_surrogate(utfchar32_t cp)
+    inline UTF_CPP_CONSTEXPR14 bool is_lead_surrogate(utfchar32_t cp)
     {
         return (cp >= LEAD_SURROGATE_MIN && cp <= LEAD_SURROGATE_MAX);
     }
 
-    inline bool is_trail_surrogate(utfchar32_t cp)
+    inline UTF_CPP_CONSTEXPR14 bool is_trail_surrogate(utfchar32_t cp)
     {
         return (cp >= TRAIL_SURROGATE_MIN && cp <= TRAIL_SURROGATE_MAX);
     }
 
-    inline bool is_surrogate(utfchar32_t cp)
+    inline UTF_CPP_CONSTEXPR14 bool is_surrogate(utfchar32_t cp)
     {
         return (cp >= LEAD_SURROGATE_MIN && cp <= TRAIL_SURROGATE_MAX);
     }
 
-    inline bool is_code_point_valid(utfchar32_t cp)
+    inline UTF_CPP_CONSTEXPR14 bool is_code_point_valid(utfchar32_t cp)
     {
         return (cp <= CODE_POINT_MAX && !utf8::internal::is_surrogate(cp));
     }
 
-    inline bool is_in_bmp(utfchar32_t cp)
+    inline UTF_CPP_CONSTEXPR14 bool is_in_bmp(utfchar32_t cp)
     {
         return cp < utfchar32_t(0x10000);
     }
 
     template <typename octet_iterator>
-    int sequence_length(octet_iterator lead_it)
+    UTF_CPP_CONSTEXPR14 int sequence_length(octet_iterator lead_it)
     {
         const utfchar8_t lead = utf8::internal::mask8(*lead_it);
         if (lead < 0x80)
@@ -140,7 +164,20 @@ namespace internal
             return 0;
     }
 
-    inline bool is_overlong_sequence(utfchar32_t cp, int length)
+    // Number of octets that encode the valid code point cp
+    inline UTF_CPP_CONSTEXPR14 std::size_t utf8_length(utfchar32_t cp)
+    {
+        if (cp < 0x80)
+            return 1;
+        else if (cp < 0x800)
+            return 2;
+        else if (cp < 0x10000)
+            return 3;
+        else
+            return 4;
+    }
+
+    inline UTF_CPP_CONSTEXPR14 bool is_overlong_sequence(utfchar32_t cp, int length)
     {
         if (cp < 0x80) {
             if (length != 1) 
@@ -161,7 +198,7 @@ namespace internal
 
     /// Helper for get_sequence_x
     template <typename octet_iterator>
-    utf_error increase_safely(octet_iterator& it, const octet_iterator end)
+    UTF_CPP_CONSTEXPR14 utf_error increase_safely(octet_iterator& it, const octet_iterator end)
     {
         if (++it == end)
             return NOT_ENOUGH_ROOM;
@@ -176,7 +213,7 @@ namespace internal
 
     /// get_sequence_x functions decode utf-8 sequences of the length x
     template <typename octet_iterator>
-    utf_error get_sequence_1(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
+    UTF_CPP_CONSTEXPR14 utf_error get_sequence_1(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
     {
         if (it == end)
             return NOT_ENOUGH_ROOM;
@@ -187,7 +224,7 @@ namespace internal
     }
 
     template <typename octet_iterator>
-    utf_error get_sequence_2(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
+    UTF_CPP_CONSTEXPR14 utf_error get_sequence_2(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
     {
         if (it == end) 
             return NOT_ENOUGH_ROOM;
@@ -202,7 +239,7 @@ namespace internal
     }
 
     template <typename octet_iterator>
-    utf_error get_sequence_3(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
+    UTF_CPP_CONSTEXPR14 utf_error get_sequence_3(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
     {
         if (it == end)
             return NOT_ENOUGH_ROOM;
@@ -221,7 +258,7 @@ namespace internal
     }
 
     template <typename octet_iterator>
-    utf_error get_sequence_4(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
+    UTF_CPP_CONSTEXPR14 utf_error get_sequence_4(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
     {
         if (it == end)
            return NOT_ENOUGH_ROOM;
@@ -246,7 +283,7 @@ namespace internal
     #undef UTF8_CPP_INCREASE_AND_RETURN_ON_ERROR
 
     template <typename octet_iterator>
-    utf_error validate_next(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
+    UTF_CPP_CONSTEXPR14 utf_error validate_next(octet_iterator& it, octet_iterator end, utfchar32_t& code_point)
     {
         if (it == end)
             return NOT_ENOUGH_ROOM;
@@ -300,13 +337,13 @@ namespace internal
     }
 
     template <typename octet_iterator>
-    inline utf_error validate_next(octet_iterator& it, octet_iterator end) {
-        utfchar32_t ignored;
+    inline UTF_CPP_CONSTEXPR14 utf_error validate_next(octet_iterator& it, octet_iterator end) {
+        utfchar32_t ignored = 0;
         return utf8::internal::validate_next(it, end, ignored);
     }
 
     template <typename word_iterator>
-    utf_error validate_next16(word_iterator& it, word_iterator end, utfchar32_t& code_point)
+    UTF_CPP_CONSTEXPR14 utf_error validate_next16(word_iterator& it, word_iterator end, utfchar32_t& code_point)
     {
         if (it == end)
             return NOT_ENOUGH_ROOM;
@@ -345,7 +382,7 @@ namespace internal
     // This function will be invoked by the overloads below, as they will know
     // the octet_type.
     template <typename octet_iterator, typename octet_type>
-    octet_iterator append(utfchar32_t cp, octet_iterator result) {
+    UTF_CPP_CONSTEXPR14 octet_iterator append(utfchar32_t cp, octet_iterator result) {
         if (cp < 0x80)                        // one octet
             *(result++) = static_cast<octet_type>(cp);
         else if (cp < 0x800) {                // two octets
@@ -369,7 +406,7 @@ namespace internal
     // One of the following overloads will be invoked from the API calls
 
     // A simple (but dangerous) case: the caller appends byte(s) to a char array
-    inline char* append(utfchar32_t cp, char* result) {
+    inline UTF_CPP_CONSTEXPR14 char* append(utfchar32_t cp, char* result) {
         return append<char*, char>(cp, result);
     }
 
@@ -386,7 +423,7 @@ namespace internal
     // Note that in this case we are not able to determine octet_type
     // so we assume it's utfchar8_t; that can cause a conversion warning if we are wrong.
     template <typename octet_iterator>
-    octet_iterator append(utfchar32_t cp, octet_iterator result) {
+    UTF_CPP_CONSTEXPR14 octet_iterator append(utfchar32_t cp, octet_iterator result) {
         return append<octet_iterator, utfchar8_t>(cp, result);
     }
 
@@ -394,7 +431,7 @@ namespace internal
     // This function will be invoked by the overloads below, as they will know
     // the word_type.
     template <typename word_iterator, typename word_type>
-    word_iterator append16(utfchar32_t cp, word_iterator result) {
+    UTF_CPP_CONSTEXPR14 word_iterator append16(utfchar32_t cp, word_iterator result) {
         if (is_in_bmp(cp))
             *(result++) = static_cast<word_type>(cp);
         else {
@@ -418,10 +455,386 @@ namespace internal
     // Note that in this case we are not able to determine word_type
     // so we assume it's utfchar16_t; that can cause a conversion warning if we are wrong.
     template <typename word_iterator>
-    word_iterator append16(utfchar32_t cp, word_iterator result) {
+    UTF_CPP_CONSTEXPR14 word_iterator append16(utfchar32_t cp, word_iterator result) {
         return append16<word_iterator, utfchar16_t>(cp, result);
     }
 
+    // Entry points for loops that own their output std::vector or std::basic_string:
+    // a sequence is encoded on the stack and appended with a single insert
+    template <typename container_type>
+    void append_back(utfchar32_t cp, container_type& container)
+    {
+        typedef typename container_type::value_type octet_type;
+        if (cp < 0x80)
+            container.push_back(static_cast<octet_type>(cp));
+        else {
+            octet_type sequence[4];
+            container.insert(container.end(), sequence, append<octet_type*, octet_type>(cp, sequence));
+        }
+    }
+
+    template <typename container_type>
+    void append16_back(utfchar32_t cp, container_type& container)
+    {
+        typedef typename container_type::value_type word_type;
+        if (is_in_bmp(cp))
+            container.push_back(static_cast<word_type>(cp));
+        else {
+            word_type pair[2];
+            container.insert(container.end(), pair, append16<word_type*, word_type>(cp, pair));
+        }
+    }
+
+    // Appends a span of contiguous input with a single range insert
+    template <typename input_type, typename container_type>
+    void copy_span_back(const input_type* first, const input_type* last, container_type& container)
+    {
+        container.insert(container.end(), first, last);
+    }
+
+    // Makes room for at least n more units, growing the capacity geometrically
+    template <typename container_type>
+    void reserve_back(container_type& container, std::size_t n)
+    {
+        if (container.capacity() - container.size() < n)
+            container.reserve(container.size() + (n > container.capacity() ? n : container.capacity()));
+    }
+
+    // Word-at-a-time helpers for contiguous input. The octets are loaded into
+    // a std::size_t with memcpy, so unaligned pointers are fine and no particular
+    // instruction set is required. Generic iterators fall back to plain loops.
+    const std::size_t WORD_SIZE       = sizeof(std::size_t);
+    const std::size_t WORD_ONES       = ~std::size_t(0) / 0xff;    // 0x0101...01
+    const std::size_t WORD_HIGH_BITS  = WORD_ONES * 0x80;          // 0x8080...80
+
+    template <typename octet_type>
+    inline std::size_t load_word(const octet_type* p)
+    {
+        std::size_t word;
+        std::memcpy(&word, p, WORD_SIZE);
+        return word;
+    }
+
+    // Counts the octets of a word that are flagged in a mask built by the functions below
+    inline std::size_t count_flagged_octets(std::size_t mask)
+    {
+        return (((mask >> 7) * WORD_ONES) >> ((WORD_SIZE - 1) * 8));
+    }
+
+    // Flags continuation octets (10xxxxxx)
+    inline std::size_t trail_octet_mask(std::size_t word)
+    {
+        return (word & ~(word << 1) & WORD_HIGH_BITS);
+    }
+
+    // Flags lead octets of four-octet sequences (11110xxx), which need a surrogate pair in UTF-16
+    inline std::size_t four_octet_lead_mask(std::size_t word)
+    {
+        return (word & (word << 1) & (word << 2) & (word << 3) & WORD_HIGH_BITS);
+    }
+
+    template <typename octet_type>
+    inline bool has_full_word(const octet_type* it, const octet_type* end)
+    {
+        return (sizeof(octet_type) == 1 && static_cast<std::size_t>(end - it) >= WORD_SIZE);
+    }
+
+    /// Returns the first non-ASCII octet in [it, end), or end
+    template <typename octet_iterator>
+    octet_iterator skip_ascii(octet_iterator it, octet_iterator end)
+    {
+        while (it != end && utf8::internal::mask8(*it) < 0x80)
+            ++it;
+        return it;
+    }
+
+    template <typename octet_type>
+    octet_type* skip_ascii(octet_type* it, octet_type* end)
+    {
+        while (utf8::internal::has_full_word(it, end) && !(utf8::internal::load_word(it) & WORD_HIGH_BITS))
+            it += WORD_SIZE;
+        while (it != end && utf8::internal::mask8(*it) < 0x80)
+            ++it;
+        return it;
+    }
+
+#if !defined(UTF_CPP_CSTR_SCALAR)
+    // NUL-terminated strings: there is no end pointer, so whole words are only loaded
+    // from aligned addresses, which may reach past the terminator (see the note on
+    // UTF_CPP_CSTR_SCALAR at the top of this file). With GCC and Clang it is a plain
+    // may_alias load.
+    template <typename octet_type>
+    inline std::size_t load_aligned_word(const octet_type* p)
+    {
+#if defined(__GNUC__)
+        typedef std::size_t __attribute__((__may_alias__)) aliased_word;
+        return *reinterpret_cast<const aliased_word*>(p);
+#else
+        return utf8::internal::load_word(p);
+#endif
+    }
+
+    template <typename octet_type>
+    inline bool is_word_aligned(const octet_type* p)
+    {
+        return (reinterpret_cast<std::size_t>(p) % WORD_SIZE == 0);
+    }
+
+    // Flags the zero octets of a word; octets above the first zero may be flagged spuriously
+    inline std::size_t zero_octet_mask(std::size_t word)
+    {
+        return ((word - WORD_ONES) & ~word & WORD_HIGH_BITS);
+    }
+#endif // !UTF_CPP_CSTR_SCALAR
+
+    /// Returns the first octet of a NUL-terminated string that is either
+    /// the terminator or non-ASCII
+    template <typename octet_type>
+    const octet_type* skip_ascii_cstr(const octet_type* it)
+    {
+#if !defined(UTF_CPP_CSTR_SCALAR)
+        for (; !utf8::internal::is_word_aligned(it); ++it)
+            if (*it == 0 || utf8::internal::mask8(*it) >= 0x80)
+                return it;
+        // (word - ones) | word has the high bit set in some octet iff
+        // the word holds a zero or a non-ASCII octet
+        for (;;) {
+            const std::size_t word = utf8::internal::load_aligned_word(it);
+            if (((word - WORD_ONES) | word) & WORD_HIGH_BITS)
+                break;
+            it += WORD_SIZE;
+        }
+#endif
+        while (*it != 0 && utf8::internal::mask8(*it) < 0x80)
+            ++it;
+        return it;
+    }
+
+    /// Counts the octets of a NUL-terminated string that are not continuation octets
+    template <typename octet_type>
+    std::size_t count_lead_octets_cstr(const octet_type* it)
+    {
+        std::size_t count = 0;
+#if !defined(UTF_CPP_CSTR_SCALAR)
+        for (; !utf8::internal::is_word_aligned(it); ++it) {
+            if (*it == 0)
+                return count;
+            if (!utf8::internal::is_trail(*it))
+                ++count;
+        }
+        for (;;) {
+            const std::size_t word = utf8::internal::load_aligned_word(it);
+            if (utf8::internal::zero_octet_mask(word))
+                break;
+            count += WORD_SIZE - utf8::internal::count_flagged_octets(utf8::internal::trail_octet_mask(word));
+            it += WORD_SIZE;
+        }
+#endif
+        for (; *it != 0; ++it)
+            if (!utf8::internal::is_trail(*it))
+                ++count;
+        return count;
+    }
+
+    /// validate_next for a NUL-terminated string: the end passed on is the terminator,
+    /// or the end of the sequence announced by the lead octet if that comes first, so
+    /// nothing past the terminator is read. A sequence cut short by the terminator is
+    /// NOT_ENOUGH_ROOM, as it would be with an end pointer. it must not point at the terminator.
+    template <typename octet_type>
+    utf_error validate_next_cstr(const octet_type*& it, utfchar32_t& code_point)
+    {
+        const octet_type* end = it + 1;
+        for (int length = utf8::internal::sequence_length(it); length > 1 && *end != 0; --length)
+            ++end;
+        return utf8::internal::validate_next(it, end, code_point);
+    }
+
+    template <typename octet_type>
+    inline utf_error validate_next_cstr(const octet_type*& it)
+    {
+        utfchar32_t ignored;
+        return utf8::internal::validate_next_cstr(it, ignored);
+    }
+
+    /// Counts the octets in [it, end) that are not continuation octets,
+    /// which is the number of code points if the range is valid UTF-8
+    template <typename octet_type>
+    std::size_t count_lead_octets(const octet_type* it, const octet_type* end)
+    {
+        std::size_t count = 0;
+        while (utf8::internal::has_full_word(it, end)) {
+            count += WORD_SIZE - utf8::internal::count_flagged_octets(
+                    utf8::internal::trail_octet_mask(utf8::internal::load_word(it)));
+            it += WORD_SIZE;
+        }
+        for (; it != end; ++it)
+            if (!utf8::internal::is_trail(*it))
+                ++count;
+        return count;
+    }
+
+    /// Counts the UTF-16 code units that valid UTF-8 in [it, end) decodes to:
+    /// one per lead octet, plus one more per four-octet lead
+    template <typename octet_type>
+    std::size_t count_utf16_units(const octet_type* it, const octet_type* end)
+    {
+        std::size_t count = 0;
+        while (utf8::internal::has_full_word(it, end)) {
+            const std::size_t word = utf8::internal::load_word(it);
+            count += WORD_SIZE - utf8::internal::count_flagged_octets(utf8::internal::trail_octet_mask(word))
+                    + utf8::internal::count_flagged_octets(utf8::internal::four_octet_lead_mask(word));
+            it += WORD_SIZE;
+        }
+        for (; it != end; ++it)
+            if (!utf8::internal::is_trail(*it))
+                count += (utf8::internal::mask8(*it) >= 0xf0) ? 2 : 1;
+        return count;
+    }
+
+    /// Steps it back over at most n lead octets without passing start and returns
+    /// how many it passed. After n of them, it points at the n-th code point before
+    /// its original position, if the range is valid.
+    template <typename octet_type>
+    std::size_t retreat_lead_octets(octet_type* start, octet_type*& it, std::size_t n)
+    {
+        std::size_t count = 0;
+        // A word never holds more than WORD_SIZE lead octets, so it cannot overshoot
+        while (n - count > WORD_SIZE && utf8::internal::has_full_word(start, it)) {
+            count += WORD_SIZE - utf8::internal::count_flagged_octets(
+                    utf8::internal::trail_octet_mask(utf8::internal::load_word(it - WORD_SIZE)));
+            it -= WORD_SIZE;
+        }
+        while (count < n && it != start)
+            if (!utf8::internal::is_trail(*(--it)))
+                ++count;
+        return count;
+    }
+
+    /// As above, for valid input with at least n code points before it:
+    /// those occupy at least n octets, which bounds the word loads
+    template <typename octet_type>
+    void retreat_lead_octets(octet_type*& it, std::size_t n)
+    {
+        while (sizeof(octet_type) == 1 && n > WORD_SIZE) {
+            n -= WORD_SIZE - utf8::internal::count_flagged_octets(
+                    utf8::internal::trail_octet_mask(utf8::internal::load_word(it - WORD_SIZE)));
+            it -= WORD_SIZE;
+        }
+        for (; n > 0; --n)
+            while (utf8::internal::is_trail(*(--it))) ;
+    }
+
+    /// Non-throwing counterpart of utf8::prior: decodes the sequence in front of it
+    /// and moves it to the lead octet; on error it is left unchanged
+    template <typename octet_iterator>
+    utf_error validate_prior(octet_iterator& it, octet_iterator start, utfchar32_t& code_point)
+    {
+        if (it == start)
+            return NOT_ENOUGH_ROOM;
+        octet_iterator lead = it;
+        while (utf8::internal::is_trail(*(--lead)))
+            if (lead == start)
+                return INVALID_LEAD;
+        octet_iterator temp = lead;
+        const utf_error err = utf8::internal::validate_next(temp, it, code_point);
+        if (err == UTF8_OK)
+            it = lead;
+        return err;
+    }
+
+    /// The start of the sequence holding the octet before offset. If the buffer was valid
+    /// before an edit at offset, the octets in front of the result are still valid.
+    template <typename octet_type>
+    std::size_t edit_window_start(const octet_type* begin, std::size_t offset)
+    {
+        std::size_t from = offset;
+        if (from > 0) {
+            --from;
+            for (int i = 0; i < 3 && from > 0 && utf8::internal::is_trail(begin[from]); ++i)
+                --from;
+        }
+        return from;
+    }
+
+    /// Widens the ASCII run at the start of [it, end) into at most n code points
+    /// Returns the number of code points written; it is advanced past them
+    template <typename octet_iterator, typename u32_type>
+    std::size_t decode_ascii(octet_iterator& it, octet_iterator end, u32_type* out, std::size_t n)
+    {
+        std::size_t count = 0;
+        while (count < n && it != end && utf8::internal::mask8(*it) < 0x80)
+            out[count++] = utf8::internal::mask8(*it++);
+        return count;
+    }
+
+    template <typename octet_type, typename u32_type>
+    std::size_t decode_ascii(octet_type*& it, octet_type* end, u32_type* out, std::size_t n)
+    {
+        std::size_t count = 0;
+        while (n - count >= WORD_SIZE && utf8::internal::has_full_word(it, end)
+                && !(utf8::internal::load_word(it) & WORD_HIGH_BITS)) {
+            for (std::size_t i = 0; i < WORD_SIZE; ++i)
+                out[count + i] = utf8::internal::mask8(it[i]);
+            it += WORD_SIZE;
+            count += WORD_SIZE;
+        }
+        while (count < n && it != end && utf8::internal::mask8(*it) < 0x80)
+            out[count++] = utf8::internal::mask8(*it++);
+        return count;
+    }
+
+    /// Word mask and pattern matching a word made of two-octet sequences only:
+    /// 110xxxxx at even offsets and 10xxxxxx at odd ones
+    inline std::size_t two_octet_run_word(utfchar8_t even, utfchar8_t odd)
+    {
+        utfchar8_t octets[sizeof(std::size_t)];
+        for (std::size_t i = 0; i < WORD_SIZE; ++i)
+            octets[i] = (i % 2 == 0) ? even : odd;
+        return utf8::internal::load_word(octets);
+    }
+
+    /// Decodes the leading run of trusted (valid) input that consists of whole words
+    /// of ASCII or of two-octet sequences; it must point at the start of a sequence.
+    /// Stops in front of the first word holding anything else.
+    template <typename unit_type, typename octet_type, typename output_iterator>
+    output_iterator decode_word_runs(octet_type*& it, octet_type* end, output_iterator out)
+    {
+        const std::size_t two_octet_mask = two_octet_run_word(0xe0, 0xc0);
+        const std::size_t two_octet_pattern = two_octet_run_word(0xc0, 0x80);
+        while (utf8::internal::has_full_word(it, end)) {
+            const std::size_t word = utf8::internal::load_word(it);
+            if (!(word & WORD_HIGH_BITS)) {
+                for (std::size_t i = 0; i < WORD_SIZE; ++i)
+                    *out++ = static_cast<unit_type>(utf8::internal::mask8(it[i]));
+            }
+            else if ((word & two_octet_mask) == two_octet_pattern) {
+                for (std::size_t i = 0; i < WORD_SIZE; i += 2)
+                    *out++ = static_cast<unit_type>(((utf8::internal::mask8(it[i]) & 0x1f) << 6) | (utf8::internal::mask8(it[i + 1]) & 0x3f));
+            }
+            else
+                break;
+            it += WORD_SIZE;
+        }
+        return out;
+    }
+
+    /// Sizes s to max_len once, lets write fill it through a pointer and shrinks it
+    /// to the end that write returns. With resize_and_overwrite the units are not
+    /// zero-filled first; write must not throw.
+    template <typename string_type, typename writer_type>
+    void write_bounded(string_type& s, std::size_t max_len, writer_type write)
+    {
+#if defined(__cpp_lib_string_resize_and_overwrite)
+        s.resize_and_overwrite(max_len, [&write](typename string_type::value_type* p, std::size_t) {
+            return static_cast<std::size_t>(write(p) - p);
+        });
+#else
+        s.resize(max_len);
+        if (max_len > 0)
+            s.resize(static_cast<std::size_t>(write(&s[0]) - &s[0]));
+#endif
+    }
+
 } // namespace internal
 
     /// The library API - functions intended to be called by the users
@@ -429,6 +842,14 @@ namespace internal
     // Byte order mark
     const utfchar8_t bom[] = {0xef, 0xbb, 0xbf};
 
+    // Byte order marks of the UTF-16 and UTF-32 encoding schemes
+    const utfchar8_t bom16le[] = {0xff, 0xfe};
+    const utfchar8_t bom16be[] = {0xfe, 0xff};
+    const utfchar8_t bom32le[] = {0xff, 0xfe, 0x00, 0x00};
+    const utfchar8_t bom32be[] = {0x00, 0x00, 0xfe, 0xff};
+
+    enum bom_type {NO_BOM, UTF8_BOM, UTF16LE_BOM, UTF16BE_BOM, UTF32LE_BOM, UTF32BE_BOM};
+
     template <typename octet_iterator>
     octet_iterator find_invalid(octet_iterator start, octet_iterator end)
     {
@@ -441,10 +862,42 @@ namespace internal
         return result;
     }
 
+    // Contiguous input: ASCII runs are skipped a word at a time
+    template <typename octet_type>
+    octet_type* find_invalid(octet_type* start, octet_type* end)
+    {
+        while (start != end) {
+            start = utf8::internal::skip_ascii(start, end);
+            if (start == end)
+                break;
+            if (utf8::internal::validate_next(start, end) != internal::UTF8_OK)
+                return start;
+        }
+        return start;
+    }
+
+    // NUL-terminated strings are validated in the same pass that looks for the terminator
     inline const char* find_invalid(const char* str)
     {
-        const char* end = str + std::strlen(str);
-        return find_invalid(str, end); 
+        for (;;) {
+            str = utf8::internal::skip_ascii_cstr(str);
+            if (*str == '\0' || utf8::internal::validate_next_cstr(str) != internal::UTF8_OK)
+                return str;
+        }
+    }
+
+    /// Returns the offset of the first invalid sequence in str, or std::string::npos,
+    /// and stores the length of str in octets; a valid string is scanned only once
+    inline std::size_t find_invalid(const char* str, std::size_t& length)
+    {
+        const char* invalid = find_invalid(str);
+        const std::size_t offset = static_cast<std::size_t>(invalid - str);
+        if (*invalid == '\0') {
+            length = offset;
+            return std::string::npos;
+        }
+        length = offset + std::strlen(invalid);
+        return offset;
     }
 
     inline std::size_t find_invalid(const std::string& s)
@@ -469,6 +922,104 @@ namespace internal
         return is_valid(s.begin(), s.end());
     }
 
+    /// Revalidates a buffer that was valid UTF-8 before the octets at offset were replaced
+    /// by inserted octets; begin and end delimit the edited buffer. Only the inserted
+    /// octets and at most 3 octets on either side of them are read. Returns the offset
+    /// of the first invalid sequence, or std::string::npos if the buffer is still valid.
+    template <typename octet_type>
+    std::size_t revalidate(const octet_type* begin, const octet_type* end, std::size_t offset, std::size_t inserted)
+    {
+        const octet_type* it = begin + utf8::internal::edit_window_start(begin, offset);
+        const octet_type* const edit_end = begin + offset + inserted;
+        while (it < edit_end) {
+            it = utf8::internal::skip_ascii(it, edit_end);
+            if (it == edit_end)
+                break;
+            const octet_type* sequence_start = it;
+            if (utf8::internal::validate_next(it, end) != internal::UTF8_OK)
+                return static_cast<std::size_t>(sequence_start - begin);
+        }
+        // The unchanged octets resynchronize at the first one that is not a continuation octet
+        if (it != end && utf8::internal::is_trail(*it))
+            return static_cast<std::size_t>(it - begin);
+        return std::string::npos;
+    }
+
+    // The truncate functions return the end of the longest prefix that fits the given
+    // limit without splitting a sequence. The input is expected to be valid and the
+    // iterators random-access; with valid input only the octets around the cut are read.
+
+    template <typename octet_iterator>
+    octet_iterator truncate(octet_iterator start, octet_iterator end, std::size_t max_octets)
+    {
+        if (static_cast<std::size_t>(end - start) <= max_octets)
+            return end;
+        octet_iterator cut = start + static_cast<std::ptrdiff_t>(max_octets);
+        // A cut on a continuation octet drops the whole sequence
+        for (int i = 0; i < 3 && cut != start && utf8::internal::is_trail(*cut); ++i)
+            --cut;
+        return cut;
+    }
+
+    inline std::size_t truncate(const std::string& s, std::size_t max_octets)
+    {
+        return static_cast<std::size_t>(truncate(s.begin(), s.end(), max_octets) - s.begin());
+    }
+
+    // Truncates UTF-8 input so that its UTF-16 form has at most max_units code units
+    template <typename octet_iterator>
+    octet_iterator truncate_to_utf16(octet_iterator start, octet_iterator end, std::size_t max_units)
+    {
+        std::size_t units = 0;
+        for (; start != end; ++start) {
+            if (utf8::internal::is_trail(*start))
+                continue;
+            units += (utf8::internal::mask8(*start) >= 0xf0) ? 2 : 1;
+            if (units > max_units)
+                break;
+        }
+        return start;
+    }
+
+    template <typename octet_type>
+    octet_type* truncate_to_utf16(octet_type* start, octet_type* end, std::size_t max_units)
+    {
+        std::size_t units = 0;
+        // Whole words can be taken as long as they fit: four-octet sequences count twice
+        while (utf8::internal::has_full_word(start, end) && max_units - units >= 2 * internal::WORD_SIZE) {
+            const std::size_t word = utf8::internal::load_word(start);
+            units += internal::WORD_SIZE
+                    - utf8::internal::count_flagged_octets(utf8::internal::trail_octet_mask(word))
+                    + utf8::internal::count_flagged_octets(utf8::internal::four_octet_lead_mask(word));
+            start += internal::WORD_SIZE;
+        }
+        for (; start != end; ++start) {
+            if (utf8::internal::is_trail(*start))
+                continue;
+            units += (utf8::internal::mask8(*start) >= 0xf0) ? 2 : 1;
+            if (units > max_units)
+                break;
+        }
+        return start;
+    }
+
+    inline std::size_t truncate_to_utf16(const std::string& s, std::size_t max_units)
+    {
+        return static_cast<std::size_t>(truncate_to_utf16(s.begin(), s.end(), max_units) - s.begin());
+    }
+
+    // Truncates UTF-16 input to at most max_units without splitting a surrogate pair
+    template <typename u16bit_iterator>
+    u16bit_iterator truncate16(u16bit_iterator start, u16bit_iterator end, std::size_t max_units)
+    {
+        if (static_cast<std::size_t>(end - start) <= max_units)
+            return end;
+        u16bit_iterator cut = start + static_cast<std::ptrdiff_t>(max_units);
+        if (cut != start && utf8::internal::is_lead_surrogate(utf8::internal::mask16(*(cut - 1))))
+            --cut;
+        return cut;
+    }
+
 
 
     template <typename octet_iterator>
@@ -485,6 +1036,49 @@ namespace internal
     {
         return starts_with_bom(s.begin(), s.end());
     } 
+
+    // Detects any of the byte order marks above. FF FE 00 00 is taken
+    // as UTF-32LE, although it may also be UTF-16LE followed by U+0000.
+    template <typename octet_iterator>
+    bom_type detect_bom(octet_iterator it, octet_iterator end)
+    {
+        utfchar8_t head[4] = {0x01, 0x01, 0x01, 0x01};
+        for (int i = 0; i < 4 && it != end; ++i, ++it)
+            head[i] = utf8::internal::mask8(*it);
+
+        if (std::memcmp(head, bom32le, sizeof(bom32le)) == 0)
+            return UTF32LE_BOM;
+        if (std::memcmp(head, bom32be, sizeof(bom32be)) == 0)
+            return UTF32BE_BOM;
+        if (std::memcmp(head, bom, sizeof(bom)) == 0)
+            return UTF8_BOM;
+        if (std::memcmp(head, bom16le, sizeof(bom16le)) == 0)
+            return UTF16LE_BOM;
+        if (std::memcmp(head, bom16be, sizeof(bom16be)) == 0)
+            return UTF16BE_BOM;
+        return NO_BOM;
+    }
+
+    inline bom_type detect_bom(const std::string& s)
+    {
+        return detect_bom(s.begin(), s.end());
+    }
+
+    inline std::size_t bom_length(bom_type type)
+    {
+        switch (type) {
+            case UTF8_BOM:
+                return sizeof(bom);
+            case UTF16LE_BOM:
+            case UTF16BE_BOM:
+                return sizeof(bom16le);
+            case UTF32LE_BOM:
+            case UTF32BE_BOM:
+                return sizeof(bom32le);
+            default:
+                return 0;
+        }
+    }
 } // namespace utf8
 
 #endif // header guard
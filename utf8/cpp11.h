@@ -29,9 +29,76 @@ DEALINGS IN THE SOFTWARE.
 #define UTF8_FOR_CPP_a184c22c_d012_11e8_a8d5_f2801f1b9fd1
 
 #include "checked.h"
+#include <memory>
+#include <type_traits>
+#include <utility>
 
 namespace utf8
 {
+    namespace internal
+    {
+        // The string wrappers validate first and count the exact result length, so that
+        // the result is sized once and written through a pointer by the unchecked
+        // converters. Invalid input goes through the checked converter instead, which
+        // throws the usual exception.
+        template <typename octet_type, typename string_type>
+        void utf8to16_into(const octet_type* start, const octet_type* end, string_type& result)
+        {
+            if (utf8::find_invalid(start, end) != end) {
+                utf8::utf8to16(start, end, std::back_inserter(result));
+                return;
+            }
+            write_bounded(result, utf8::internal::count_utf16_units(start, end), [start, end](typename string_type::value_type* out) {
+                return utf8::unchecked::utf8to16(start, end, out);
+            });
+        }
+
+        template <typename octet_type, typename string_type>
+        void utf8to32_into(const octet_type* start, const octet_type* end, string_type& result)
+        {
+            if (utf8::find_invalid(start, end) != end) {
+                utf8::utf8to32(start, end, std::back_inserter(result));
+                return;
+            }
+            write_bounded(result, utf8::internal::count_lead_octets(start, end), [start, end](typename string_type::value_type* out) {
+                return utf8::unchecked::utf8to32(start, end, out);
+            });
+        }
+
+        template <typename u16_type, typename string_type>
+        void utf16to8_into(const u16_type* start, const u16_type* end, string_type& result)
+        {
+            std::size_t length = 0;
+            for (const u16_type* it = start; it != end; ) {
+                utfchar32_t cp = 0;
+                if (utf8::internal::validate_next16(it, end, cp) != UTF8_OK) {
+                    utf8::utf16to8(start, end, std::back_inserter(result));
+                    return;
+                }
+                length += utf8::internal::utf8_length(cp);
+            }
+            write_bounded(result, length, [start, end](typename string_type::value_type* out) {
+                return utf8::unchecked::utf16to8(start, end, out);
+            });
+        }
+
+        template <typename u32_type, typename string_type>
+        void utf32to8_into(const u32_type* start, const u32_type* end, string_type& result)
+        {
+            std::size_t length = 0;
+            for (const u32_type* it = start; it != end; ++it) {
+                if (!utf8::internal::is_code_point_valid(*it)) {
+                    utf8::utf32to8(start, end, std::back_inserter(result));
+                    return;
+                }
+                length += utf8::internal::utf8_length(*it);
+            }
+            write_bounded(result, length, [start, end](typename string_type::value_type* out) {
+                return utf8::unchecked::utf32to8(start, end, out);
+            });
+        }
+    } // namespace internal
+
     inline void append16(utfchar32_t cp, std::u16string& s)
     {
         append16(cp, std::back_inserter(s));
@@ -40,28 +107,84 @@ namespace utf8
     inline std::string utf16to8(const std::u16string& s)
     {
         std::string result;
-        utf16to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u16string utf8to16(const std::string& s)
     {
         std::u16string result;
-        utf8to16(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::string utf32to8(const std::u32string& s)
     {
         std::string result;
-        utf32to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u32string utf8to32(const std::string& s)
     {
         std::u32string result;
-        utf8to32(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    namespace internal
+    {
+        template <typename...>
+        struct void_type { typedef void type; };
+
+        // Only types with a value_type and an allocate(n) count as allocators, so that the
+        // allocator-aware overloads below do not capture i.e. replace_invalid(s, '?')
+        template <typename allocator_type, typename = void>
+        struct is_allocator : std::false_type {};
+
+        template <typename allocator_type>
+        struct is_allocator<allocator_type, typename void_type<typename allocator_type::value_type,
+                decltype(std::declval<allocator_type&>().allocate(std::size_t(1)))>::type> : std::true_type {};
+
+        // String type whose storage comes from alloc, rebound to the character type.
+        // It is a substitution failure for anything that is not an allocator.
+        template <typename char_type, typename allocator_type>
+        using rebound_string = std::basic_string<char_type, std::char_traits<char_type>,
+                typename std::allocator_traits<typename std::enable_if<is_allocator<allocator_type>::value,
+                    allocator_type>::type>::template rebind_alloc<char_type> >;
+    }
+
+    // Allocator-aware variants: the result is allocated with a copy of alloc
+
+    template <typename allocator_type>
+    internal::rebound_string<char, allocator_type> utf16to8(const std::u16string& s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char, allocator_type> result(alloc);
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char16_t, allocator_type> utf8to16(const std::string& s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char16_t, allocator_type> result(alloc);
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char, allocator_type> utf32to8(const std::u32string& s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char, allocator_type> result(alloc);
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char32_t, allocator_type> utf8to32(const std::string& s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char32_t, allocator_type> result(alloc);
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 } // namespace utf8
@@ -29,34 +29,38 @@ DEALINGS IN THE SOFTWARE.
 #define UTF8_FOR_CPP_7e906c01_03a3_4daf_b420_ea7ea952b3c9
 
 #include "cpp11.h"
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define UTF_CPP_HAS_PMR
+#endif
 
 namespace utf8
 {
     inline std::string utf16to8(std::u16string_view s)
     {
         std::string result;
-        utf16to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u16string utf8to16(std::string_view s)
     {
         std::u16string result;
-        utf8to16(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::string utf32to8(std::u32string_view s)
     {
         std::string result;
-        utf32to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u32string utf8to32(std::string_view s)
     {
         std::u32string result;
-        utf8to32(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
@@ -74,21 +78,171 @@ namespace utf8
     inline std::string replace_invalid(std::string_view s, char32_t replacement)
     {
         std::string result;
-        replace_invalid(s.begin(), s.end(), std::back_inserter(result), replacement);
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, replacement);
         return result;
     }
 
     inline std::string replace_invalid(std::string_view s)
     {
         std::string result;
-        replace_invalid(s.begin(), s.end(), std::back_inserter(result));
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, utfchar32_t(0xfffd));
         return result;
     }
 
+    inline std::size_t truncate(std::string_view s, std::size_t max_octets)
+    {
+        return static_cast<std::size_t>(truncate(s.begin(), s.end(), max_octets) - s.begin());
+    }
+
+    inline std::size_t truncate_to_utf16(std::string_view s, std::size_t max_units)
+    {
+        return static_cast<std::size_t>(truncate_to_utf16(s.begin(), s.end(), max_units) - s.begin());
+    }
+
     inline bool starts_with_bom(std::string_view s)
     {
         return starts_with_bom(s.begin(), s.end());
     }
+
+    inline bom_type detect_bom(std::string_view s)
+    {
+        return detect_bom(s.begin(), s.end());
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char, allocator_type> utf16to8(std::u16string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char, allocator_type> result(alloc);
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char16_t, allocator_type> utf8to16(std::string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char16_t, allocator_type> result(alloc);
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char, allocator_type> utf32to8(std::u32string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char, allocator_type> result(alloc);
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char32_t, allocator_type> utf8to32(std::string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char32_t, allocator_type> result(alloc);
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char, allocator_type> replace_invalid(std::string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char, allocator_type> result(alloc);
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, utfchar32_t(0xfffd));
+        return result;
+    }
+
+    // Result of the literal converters below: room for one unit per octet of the
+    // literal, which is always enough, and a terminating zero
+    template <typename unit_type, std::size_t capacity>
+    struct fixed_string
+    {
+        unit_type units[capacity + 1] = {};
+        std::size_t length = 0;
+
+        constexpr const unit_type* c_str() const { return units; }
+        constexpr std::size_t size() const { return length; }
+        constexpr std::basic_string_view<unit_type> view() const { return std::basic_string_view<unit_type>(units, length); }
+        constexpr operator std::basic_string_view<unit_type>() const { return view(); }
+    };
+
+namespace internal
+{
+    // The throw is not a constant expression, so an invalid literal fails to compile
+    template <typename unit_type, std::size_t capacity, typename octet_type>
+    constexpr fixed_string<unit_type, capacity> decode_literal(const octet_type* it, const octet_type* end)
+    {
+        fixed_string<unit_type, capacity> result;
+        unit_type* out = result.units;
+        while (it != end) {
+            utfchar32_t cp = 0;
+            if (utf8::internal::validate_next(it, end, cp) != internal::UTF8_OK)
+                throw invalid_utf8(utf8::internal::mask8(*it));
+            if constexpr (sizeof(unit_type) == sizeof(utfchar16_t))
+                out = utf8::internal::append16(cp, out);
+            else
+                *out++ = static_cast<unit_type>(cp);
+        }
+        result.length = static_cast<std::size_t>(out - result.units);
+        return result;
+    }
+
+    // The terminating zero of a string literal is not part of the text
+    template <typename octet_type, std::size_t N>
+    constexpr const octet_type* literal_end(const octet_type (&s)[N])
+    {
+        return (N > 0 && s[N - 1] == 0) ? s + N - 1 : s + N;
+    }
+} // namespace internal
+
+// With consteval an invalid literal is rejected even outside of a constant expression
+#if defined(__cpp_consteval)
+    #define UTF_CPP_CONSTEVAL consteval
+#else
+    #define UTF_CPP_CONSTEVAL constexpr
+#endif
+
+    // Compile-time conversion of UTF-8 literals, i.e.
+    // static constexpr auto key = utf8::utf8to16_literal("...");
+    template <std::size_t N>
+    UTF_CPP_CONSTEVAL fixed_string<char16_t, N> utf8to16_literal(const char (&s)[N])
+    {
+        return internal::decode_literal<char16_t, N>(s, internal::literal_end(s));
+    }
+
+    template <std::size_t N>
+    UTF_CPP_CONSTEVAL fixed_string<char32_t, N> utf8to32_literal(const char (&s)[N])
+    {
+        return internal::decode_literal<char32_t, N>(s, internal::literal_end(s));
+    }
+
+#ifdef UTF_CPP_HAS_PMR
+    // The same conversions with the result allocated from a memory resource
+    namespace pmr
+    {
+        inline std::pmr::string utf16to8(std::u16string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf16to8(s, std::pmr::polymorphic_allocator<char>(resource));
+        }
+
+        inline std::pmr::u16string utf8to16(std::string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf8to16(s, std::pmr::polymorphic_allocator<char16_t>(resource));
+        }
+
+        inline std::pmr::string utf32to8(std::u32string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf32to8(s, std::pmr::polymorphic_allocator<char>(resource));
+        }
+
+        inline std::pmr::u32string utf8to32(std::string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf8to32(s, std::pmr::polymorphic_allocator<char32_t>(resource));
+        }
+
+        inline std::pmr::string replace_invalid(std::string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::replace_invalid(s, std::pmr::polymorphic_allocator<char>(resource));
+        }
+    } // namespace utf8::pmr
+#endif // UTF_CPP_HAS_PMR
  
 } // namespace utf8
 
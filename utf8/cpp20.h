@@ -35,56 +35,56 @@ namespace utf8
     inline std::u8string utf16tou8(const std::u16string& s)
     {
         std::u8string result;
-        utf16to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u8string utf16tou8(std::u16string_view s)
     {
         std::u8string result;
-        utf16to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u16string utf8to16(const std::u8string& s)
     {
         std::u16string result;
-        utf8to16(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u16string utf8to16(const std::u8string_view& s)
     {
         std::u16string result;
-        utf8to16(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u8string utf32tou8(const std::u32string& s)
     {
         std::u8string result;
-        utf32to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u8string utf32tou8(const std::u32string_view& s)
     {
         std::u8string result;
-        utf32to8(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u32string utf8to32(const std::u8string& s)
     {
         std::u32string result;
-        utf8to32(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
     inline std::u32string utf8to32(const std::u8string_view& s)
     {
         std::u32string result;
-        utf8to32(s.begin(), s.end(), std::back_inserter(result));
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
         return result;
     }
 
@@ -102,14 +102,14 @@ namespace utf8
     inline std::u8string replace_invalid(const std::u8string& s, char32_t replacement)
     {
         std::u8string result;
-        replace_invalid(s.begin(), s.end(), std::back_inserter(result), replacement);
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, replacement);
         return result;
     }
 
     inline std::u8string replace_invalid(const std::u8string& s)
     {
         std::u8string result;
-        replace_invalid(s.begin(), s.end(), std::back_inserter(result));
+        internal::replace_invalid_into(s.data(), s.data() + s.size(), result, utfchar32_t(0xfffd));
         return result;
     }
 
@@ -117,6 +117,80 @@ namespace utf8
     {
         return starts_with_bom(s.begin(), s.end());
     }
+
+    inline bom_type detect_bom(const std::u8string& s)
+    {
+        return detect_bom(s.begin(), s.end());
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char8_t, allocator_type> utf16tou8(std::u16string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char8_t, allocator_type> result(alloc);
+        internal::utf16to8_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char16_t, allocator_type> utf8to16(std::u8string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char16_t, allocator_type> result(alloc);
+        internal::utf8to16_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char8_t, allocator_type> utf32tou8(std::u32string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char8_t, allocator_type> result(alloc);
+        internal::utf32to8_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <typename allocator_type>
+    internal::rebound_string<char32_t, allocator_type> utf8to32(std::u8string_view s, const allocator_type& alloc)
+    {
+        internal::rebound_string<char32_t, allocator_type> result(alloc);
+        internal::utf8to32_into(s.data(), s.data() + s.size(), result);
+        return result;
+    }
+
+    template <std::size_t N>
+    UTF_CPP_CONSTEVAL fixed_string<char16_t, N> utf8to16_literal(const char8_t (&s)[N])
+    {
+        return internal::decode_literal<char16_t, N>(s, internal::literal_end(s));
+    }
+
+    template <std::size_t N>
+    UTF_CPP_CONSTEVAL fixed_string<char32_t, N> utf8to32_literal(const char8_t (&s)[N])
+    {
+        return internal::decode_literal<char32_t, N>(s, internal::literal_end(s));
+    }
+
+#ifdef UTF_CPP_HAS_PMR
+    namespace pmr
+    {
+        inline std::pmr::u8string utf16tou8(std::u16string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf16tou8(s, std::pmr::polymorphic_allocator<char8_t>(resource));
+        }
+
+        inline std::pmr::u16string utf8to16(std::u8string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf8to16(s, std::pmr::polymorphic_allocator<char16_t>(resource));
+        }
+
+        inline std::pmr::u8string utf32tou8(std::u32string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf32tou8(s, std::pmr::polymorphic_allocator<char8_t>(resource));
+        }
+
+        inline std::pmr::u32string utf8to32(std::u8string_view s, std::pmr::memory_resource* resource)
+        {
+            return utf8::utf8to32(s, std::pmr::polymorphic_allocator<char32_t>(resource));
+        }
+    } // namespace utf8::pmr
+#endif // UTF_CPP_HAS_PMR
  
 } // namespace utf8
 
@@ -0,0 +1,389 @@
+/*
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef UTF8_FOR_CPP_INDEX_H_1bcb8bca_d961_4a31_9fdb_95e7bb3b4073
+#define UTF8_FOR_CPP_INDEX_H_1bcb8bca_d961_4a31_9fdb_95e7bb3b4073
+
+#include "core.h"
+#include <algorithm>
+#include <vector>
+
+namespace utf8
+{
+    // Sampled index of code point positions in a UTF-8 buffer.
+    // A checkpoint is recorded every stride code points, so that any lookup
+    // needs a binary search plus at most stride sequence steps.
+    // The buffer is not owned and is assumed to be valid UTF-8; pass the
+    // current buffer start to every call, as it may move while the document grows.
+    class offset_index {
+    public:
+        struct position {
+            std::size_t octets;
+            std::size_t code_points;
+            std::size_t utf16_units;
+        };
+
+        explicit offset_index(std::size_t stride = 256) :
+                stride_(stride > 0 ? stride : 1)
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            const position zero = {0, 0, 0};
+            checkpoints_.assign(1, zero);
+            total_ = zero;
+            last_checkpoint_ = 0;
+        }
+
+        std::size_t stride() const { return stride_; }
+        std::size_t octet_count() const { return total_.octets; }
+        std::size_t code_point_count() const { return total_.code_points; }
+        std::size_t utf16_length() const { return total_.utf16_units; }
+
+        // Indexes the octets in [begin + octet_count(), end).
+        // The appended range may end in the middle of a sequence.
+        template <typename octet_type>
+        void append(const octet_type* begin, const octet_type* end)
+        {
+            scan(begin, end);
+        }
+
+        // Updates the index after the octets [offset, offset + removed) of the
+        // indexed buffer were replaced by inserted octets; begin and end delimit
+        // the edited buffer. Only the segment between the checkpoints around the
+        // edit is rescanned, the checkpoints after it are shifted.
+        template <typename octet_type>
+        void replace(const octet_type* begin, const octet_type* end,
+                std::size_t offset, std::size_t removed, std::size_t inserted)
+        {
+            const std::size_t first = (offset > 0) ? nearest_index(&position::octets, offset - 1) : 0;
+            std::size_t last = first + 1;
+            while (last < checkpoints_.size() && checkpoints_[last].octets < offset + removed)
+                ++last;
+            std::vector<position> tail(checkpoints_.begin() + static_cast<std::ptrdiff_t>(last), checkpoints_.end());
+            const position old_total = total_;
+            checkpoints_.resize(first + 1);
+            total_ = checkpoints_.back();
+            last_checkpoint_ = total_.code_points;
+            if (tail.empty()) {
+                scan(begin, end);
+                return;
+            }
+            // The octets after the edit did not change, so the old checkpoints still fall on lead octets
+            scan(begin, begin + (tail.front().octets - removed + inserted));
+            const position old_front = tail.front();
+            for (std::size_t i = 0; i < tail.size(); ++i) {
+                tail[i].octets = tail[i].octets - removed + inserted;
+                tail[i].code_points = tail[i].code_points - old_front.code_points + total_.code_points;
+                tail[i].utf16_units = tail[i].utf16_units - old_front.utf16_units + total_.utf16_units;
+            }
+            total_.octets = old_total.octets - removed + inserted;
+            total_.code_points = old_total.code_points - old_front.code_points + tail.front().code_points;
+            total_.utf16_units = old_total.utf16_units - old_front.utf16_units + tail.front().utf16_units;
+            checkpoints_.insert(checkpoints_.end(), tail.begin(), tail.end());
+            last_checkpoint_ = checkpoints_.back().code_points;
+        }
+
+        // Lookups round down to the start of the containing code point and
+        // clamp to the end of the indexed range.
+        template <typename octet_type>
+        position locate_code_point(const octet_type* begin, std::size_t code_point) const
+        {
+            position pos = nearest(&position::code_points, code_point);
+            while (pos.code_points < code_point && pos.octets < total_.octets)
+                step(begin, pos);
+            return pos;
+        }
+
+        template <typename octet_type>
+        position locate_octet(const octet_type* begin, std::size_t octet) const
+        {
+            position pos = nearest(&position::octets, octet);
+            position next = pos;
+            while (next.octets <= octet && next.octets < total_.octets) {
+                pos = next;
+                step(begin, next);
+            }
+            return (next.octets <= octet) ? next : pos;
+        }
+
+        template <typename octet_type>
+        position locate_utf16(const octet_type* begin, std::size_t utf16_unit) const
+        {
+            position pos = nearest(&position::utf16_units, utf16_unit);
+            position next = pos;
+            while (next.utf16_units <= utf16_unit && next.octets < total_.octets) {
+                pos = next;
+                step(begin, next);
+            }
+            return (next.utf16_units <= utf16_unit) ? next : pos;
+        }
+
+        template <typename octet_type>
+        utfchar32_t code_point_at(const octet_type* begin, std::size_t code_point) const
+        {
+            const octet_type* it = begin + locate_code_point(begin, code_point).octets;
+            utfchar32_t cp = 0;
+            utf8::internal::validate_next(it, begin + total_.octets, cp);
+            return cp;
+        }
+
+        // Counterparts of utf8::advance and utf8::distance for positions inside the indexed range
+        template <typename octet_type, typename distance_type>
+        void advance(const octet_type* begin, const octet_type*& it, distance_type n) const
+        {
+            const std::size_t from = locate_octet(begin, static_cast<std::size_t>(it - begin)).code_points;
+            const distance_type zero(0);
+            std::size_t to = from;
+            if (n < zero) {
+                const std::size_t back = static_cast<std::size_t>(-n);
+                to = (back > from) ? 0 : from - back;
+            }
+            else
+                to = from + static_cast<std::size_t>(n);
+            it = begin + locate_code_point(begin, to).octets;
+        }
+
+        template <typename octet_type>
+        std::ptrdiff_t distance(const octet_type* begin, const octet_type* first, const octet_type* last) const
+        {
+            const std::size_t first_cp = locate_octet(begin, static_cast<std::size_t>(first - begin)).code_points;
+            const std::size_t last_cp = locate_octet(begin, static_cast<std::size_t>(last - begin)).code_points;
+            return static_cast<std::ptrdiff_t>(last_cp) - static_cast<std::ptrdiff_t>(first_cp);
+        }
+
+    private:
+        struct compare_field {
+            std::size_t position::* field;
+            bool operator () (std::size_t value, const position& pos) const { return value < pos.*field; }
+        };
+
+        // The last checkpoint at or before value
+        std::size_t nearest_index(std::size_t position::* field, std::size_t value) const
+        {
+            compare_field comp = {field};
+            std::vector<position>::const_iterator it =
+                    std::upper_bound(checkpoints_.begin(), checkpoints_.end(), value, comp);
+            return static_cast<std::size_t>(it - checkpoints_.begin()) - 1;
+        }
+
+        position nearest(std::size_t position::* field, std::size_t value) const
+        {
+            return checkpoints_[nearest_index(field, value)];
+        }
+
+        // Advances total_ over [begin + total_.octets, end), adding checkpoints on the way
+        template <typename octet_type>
+        void scan(const octet_type* begin, const octet_type* end)
+        {
+            const octet_type* it = begin + total_.octets;
+            while (it != end) {
+                // Count whole words in bulk while they cannot reach the next checkpoint
+                if (utf8::internal::has_full_word(it, end)
+                        && last_checkpoint_ + stride_ - total_.code_points >= internal::WORD_SIZE) {
+                    const std::size_t word = utf8::internal::load_word(it);
+                    const std::size_t leads = internal::WORD_SIZE
+                            - utf8::internal::count_flagged_octets(utf8::internal::trail_octet_mask(word));
+                    total_.code_points += leads;
+                    total_.utf16_units += leads
+                            + utf8::internal::count_flagged_octets(utf8::internal::four_octet_lead_mask(word));
+                    total_.octets += internal::WORD_SIZE;
+                    it += internal::WORD_SIZE;
+                    continue;
+                }
+                if (!utf8::internal::is_trail(*it)) {
+                    if (total_.code_points == last_checkpoint_ + stride_) {
+                        checkpoints_.push_back(total_);
+                        last_checkpoint_ += stride_;
+                    }
+                    ++total_.code_points;
+                    total_.utf16_units += (utf8::internal::mask8(*it) >= 0xf0) ? 2 : 1;
+                }
+                ++total_.octets;
+                ++it;
+            }
+        }
+
+        // Moves pos over one code point, counting octets the same way as append()
+        template <typename octet_type>
+        void step(const octet_type* begin, position& pos) const
+        {
+            pos.utf16_units += (utf8::internal::mask8(begin[pos.octets]) >= 0xf0) ? 2 : 1;
+            ++pos.code_points;
+            ++pos.octets;
+            while (pos.octets < total_.octets && utf8::internal::is_trail(begin[pos.octets]))
+                ++pos.octets;
+        }
+
+        std::size_t stride_;
+        std::vector<position> checkpoints_;
+        position total_;
+        std::size_t last_checkpoint_;
+    }; // class offset_index
+
+    // Maps between octet offsets, UTF-16 offsets, code point indices and
+    // (line, column) pairs of a UTF-8 document, as editors and language
+    // servers need. Lines are terminated by '\n' and columns are counted
+    // in UTF-16 units. Validation, sampling and line breaking are done block
+    // by block in a single pass; edits only rescan the changed segment.
+    class position_map {
+    public:
+        struct line_column {
+            std::size_t line;
+            std::size_t column;
+        };
+
+        explicit position_map(std::size_t stride = 256) :
+                index_(stride), line_starts_(1, 0), first_invalid_(std::string::npos) {}
+
+        template <typename octet_type>
+        void assign(const octet_type* begin, const octet_type* end)
+        {
+            index_.clear();
+            line_starts_.assign(1, 0);
+            first_invalid_ = std::string::npos;
+            const octet_type* validated = begin;
+            const octet_type* it = begin;
+            while (it != end) {
+                const octet_type* block_end = (static_cast<std::size_t>(end - it) > BLOCK_SIZE) ? it + BLOCK_SIZE : end;
+                if (first_invalid_ == std::string::npos)
+                    validated = validate(begin, validated, block_end, end);
+                index_.append(begin, block_end);
+                add_line_starts(begin, it, block_end, line_starts_);
+                it = block_end;
+            }
+        }
+
+        // Updates the map after the octets [offset, offset + removed) were replaced
+        // by inserted octets; begin and end delimit the edited document
+        template <typename octet_type>
+        void replace(const octet_type* begin, const octet_type* end,
+                std::size_t offset, std::size_t removed, std::size_t inserted)
+        {
+            index_.replace(begin, end, offset, removed, inserted);
+
+            // A line start at offset belongs to a newline before the edit, so it is kept
+            const std::size_t first = static_cast<std::size_t>(
+                    std::upper_bound(line_starts_.begin(), line_starts_.end(), offset) - line_starts_.begin());
+            const std::size_t last = static_cast<std::size_t>(
+                    std::upper_bound(line_starts_.begin(), line_starts_.end(), offset + removed) - line_starts_.begin());
+            std::vector<std::size_t> added;
+            add_line_starts(begin, begin + offset, begin + offset + inserted, added);
+            for (std::size_t i = last; i < line_starts_.size(); ++i)
+                line_starts_[i] = line_starts_[i] - removed + inserted;
+            line_starts_.erase(line_starts_.begin() + static_cast<std::ptrdiff_t>(first),
+                    line_starts_.begin() + static_cast<std::ptrdiff_t>(last));
+            line_starts_.insert(line_starts_.begin() + static_cast<std::ptrdiff_t>(first), added.begin(), added.end());
+
+            // An invalid sequence well before the edit is not affected by it
+            if (first_invalid_ != std::string::npos && first_invalid_ + 4 <= offset)
+                return;
+            // Around the edit the octets were valid, so only the edit window needs a look;
+            // an invalid sequence well after it just moves
+            if (first_invalid_ == std::string::npos || first_invalid_ >= offset + removed + 4) {
+                const std::size_t moved = (first_invalid_ == std::string::npos) ?
+                        std::string::npos : first_invalid_ - removed + inserted;
+                const std::size_t found = utf8::revalidate(begin, end, offset, inserted);
+                first_invalid_ = (found != std::string::npos) ? found : moved;
+                return;
+            }
+            // The edit touches the invalid sequence: restart at the sequence holding
+            // the last octet before the edit and rescan the rest of the document
+            const std::size_t from = utf8::internal::edit_window_start(begin,
+                    (first_invalid_ < offset) ? first_invalid_ : offset);
+            first_invalid_ = std::string::npos;
+            validate(begin, begin + from, end, end);
+        }
+
+        const offset_index& index() const { return index_; }
+        std::size_t line_count() const { return line_starts_.size(); }
+        bool is_valid() const { return first_invalid_ == std::string::npos; }
+        // Octet offset of the first invalid sequence, or std::string::npos
+        std::size_t first_invalid() const { return first_invalid_; }
+
+        template <typename octet_type>
+        line_column to_line_column(const octet_type* begin, std::size_t octet) const
+        {
+            const std::size_t line = static_cast<std::size_t>(
+                    std::upper_bound(line_starts_.begin(), line_starts_.end(), octet) - line_starts_.begin()) - 1;
+            const std::size_t line_start = index_.locate_octet(begin, line_starts_[line]).utf16_units;
+            const line_column result = {line, index_.locate_octet(begin, octet).utf16_units - line_start};
+            return result;
+        }
+
+        // Columns past the end of a line are clamped to its terminating newline
+        template <typename octet_type>
+        std::size_t to_octet(const octet_type* begin, const line_column& position) const
+        {
+            if (position.line >= line_starts_.size())
+                return index_.octet_count();
+            const std::size_t line_end = (position.line + 1 < line_starts_.size()) ?
+                    line_starts_[position.line + 1] - 1 : index_.octet_count();
+            const std::size_t utf16_units =
+                    index_.locate_octet(begin, line_starts_[position.line]).utf16_units + position.column;
+            const std::size_t octet = index_.locate_utf16(begin, utf16_units).octets;
+            return (octet < line_end) ? octet : line_end;
+        }
+
+    private:
+        static const std::size_t BLOCK_SIZE = 4096;
+
+        // Validates the sequences starting in [it, limit) and returns the position after
+        // the last of them; the first error is recorded as an offset from begin
+        template <typename octet_type>
+        const octet_type* validate(const octet_type* begin, const octet_type* it,
+                const octet_type* limit, const octet_type* end)
+        {
+            while (it < limit) {
+                it = utf8::internal::skip_ascii(it, limit);
+                if (it == limit)
+                    break;
+                const octet_type* sequence_start = it;
+                if (utf8::internal::validate_next(it, end) != internal::UTF8_OK) {
+                    first_invalid_ = static_cast<std::size_t>(sequence_start - begin);
+                    break;
+                }
+            }
+            return it;
+        }
+
+        template <typename octet_type>
+        static void add_line_starts(const octet_type* begin, const octet_type* it, const octet_type* end,
+                std::vector<std::size_t>& line_starts)
+        {
+            while ((it = std::find(it, end, '\n')) != end)
+                line_starts.push_back(static_cast<std::size_t>(++it - begin));
+        }
+
+        offset_index index_;
+        std::vector<std::size_t> line_starts_;
+        std::size_t first_invalid_;
+    }; // class position_map
+
+} // namespace utf8
+
+#endif // header guard
@@ -0,0 +1,176 @@
+/*
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+
+#ifndef UTF8_FOR_CPP_NOTHROW_H_5f0c2a4e_8b7d_4c11_a3e6_2d9f6b1c8e47
+#define UTF8_FOR_CPP_NOTHROW_H_5f0c2a4e_8b7d_4c11_a3e6_2d9f6b1c8e47
+
+// Only depends on core.h, so it can be used in code built without exceptions
+#include "core.h"
+
+namespace utf8
+{
+    // Counterparts of the checked functions that report errors instead of throwing.
+    // The validation rules are the same; where the checked version would throw
+    // invalid_utf8, invalid_utf16, invalid_code_point or not_enough_room, these
+    // return the matching utf_error and stop in front of the offending input.
+    namespace nothrow
+    {
+        // The error values, so that callers need not name utf8::internal
+        typedef internal::utf_error utf_error;
+        using internal::UTF8_OK;
+        using internal::NOT_ENOUGH_ROOM;
+        using internal::INVALID_LEAD;
+        using internal::INCOMPLETE_SEQUENCE;
+        using internal::OVERLONG_SEQUENCE;
+        using internal::INVALID_CODE_POINT;
+
+        // error is UTF8_OK on success. offset is the number of input units read
+        // before the error, or all of them on success. value is the decoded code
+        // point for next/next16 and the output iterator for the conversions.
+        template <typename value_type>
+        struct result {
+            utf_error error;
+            std::size_t offset;
+            value_type value;
+
+            bool ok() const { return error == internal::UTF8_OK; }
+        };
+
+        template <typename value_type>
+        inline result<value_type> make_result(utf_error error, std::size_t offset, value_type value)
+        {
+            result<value_type> res = {error, offset, value};
+            return res;
+        }
+
+        template <typename octet_iterator>
+        result<octet_iterator> append(utfchar32_t cp, octet_iterator out)
+        {
+            if (!utf8::internal::is_code_point_valid(cp))
+                return make_result(internal::INVALID_CODE_POINT, 0, out);
+            return make_result(internal::UTF8_OK, 1, internal::append(cp, out));
+        }
+
+        template <typename word_iterator>
+        result<word_iterator> append16(utfchar32_t cp, word_iterator out)
+        {
+            if (!utf8::internal::is_code_point_valid(cp))
+                return make_result(internal::INVALID_CODE_POINT, 0, out);
+            return make_result(internal::UTF8_OK, 1, internal::append16(cp, out));
+        }
+
+        // On error it is left at the start of the invalid sequence and offset is 0,
+        // otherwise offset is the length of the sequence it moved past
+        template <typename octet_iterator>
+        result<utfchar32_t> next(octet_iterator& it, octet_iterator end)
+        {
+            const octet_iterator sequence_start = it;
+            utfchar32_t cp = 0;
+            const utf_error err = utf8::internal::validate_next(it, end, cp);
+            return make_result(err, static_cast<std::size_t>(std::distance(sequence_start, it)), cp);
+        }
+
+        template <typename word_iterator>
+        result<utfchar32_t> next16(word_iterator& it, word_iterator end)
+        {
+            const word_iterator sequence_start = it;
+            utfchar32_t cp = 0;
+            const utf_error err = utf8::internal::validate_next16(it, end, cp);
+            return make_result(err, static_cast<std::size_t>(std::distance(sequence_start, it)), cp);
+        }
+
+        // A lead surrogate at the end of the input is NOT_ENOUGH_ROOM, one that is not
+        // followed by a trail surrogate is INCOMPLETE_SEQUENCE, a lone trail surrogate is INVALID_LEAD
+        template <typename u16bit_iterator, typename octet_iterator>
+        result<octet_iterator> utf16to8(u16bit_iterator start, u16bit_iterator end, octet_iterator out)
+        {
+            std::size_t offset = 0;
+            while (start != end) {
+                utfchar32_t cp = utf8::internal::mask16(*start++);
+                if (utf8::internal::is_lead_surrogate(cp)) {
+                    if (start == end)
+                        return make_result(internal::NOT_ENOUGH_ROOM, offset, out);
+                    const utfchar32_t trail_surrogate = utf8::internal::mask16(*start++);
+                    if (!utf8::internal::is_trail_surrogate(trail_surrogate))
+                        return make_result(internal::INCOMPLETE_SEQUENCE, offset, out);
+                    cp = (cp << 10) + trail_surrogate + internal::SURROGATE_OFFSET;
+                    offset += 2;
+                }
+                else if (utf8::internal::is_trail_surrogate(cp))
+                    return make_result(internal::INVALID_LEAD, offset, out);
+                else
+                    ++offset;
+                out = internal::append(cp, out);
+            }
+            return make_result(internal::UTF8_OK, offset, out);
+        }
+
+        template <typename u16bit_iterator, typename octet_iterator>
+        result<u16bit_iterator> utf8to16(octet_iterator start, octet_iterator end, u16bit_iterator out)
+        {
+            std::size_t offset = 0;
+            while (start != end) {
+                octet_iterator sequence_start = start;
+                utfchar32_t cp = 0;
+                const utf_error err = utf8::internal::validate_next(start, end, cp);
+                if (err != internal::UTF8_OK)
+                    return make_result(err, offset, out);
+                offset += static_cast<std::size_t>(std::distance(sequence_start, start));
+                out = internal::append16(cp, out);
+            }
+            return make_result(internal::UTF8_OK, offset, out);
+        }
+
+        template <typename octet_iterator, typename u32bit_iterator>
+        result<octet_iterator> utf32to8(u32bit_iterator start, u32bit_iterator end, octet_iterator out)
+        {
+            std::size_t offset = 0;
+            for (; start != end; ++start, ++offset) {
+                if (!utf8::internal::is_code_point_valid(*start))
+                    return make_result(internal::INVALID_CODE_POINT, offset, out);
+                out = internal::append(*start, out);
+            }
+            return make_result(internal::UTF8_OK, offset, out);
+        }
+
+        template <typename octet_iterator, typename u32bit_iterator>
+        result<u32bit_iterator> utf8to32(octet_iterator start, octet_iterator end, u32bit_iterator out)
+        {
+            std::size_t offset = 0;
+            while (start != end) {
+                octet_iterator sequence_start = start;
+                utfchar32_t cp = 0;
+                const utf_error err = utf8::internal::validate_next(start, end, cp);
+                if (err != internal::UTF8_OK)
+                    return make_result(err, offset, out);
+                offset += static_cast<std::size_t>(std::distance(sequence_start, start));
+                *out++ = cp;
+            }
+            return make_result(internal::UTF8_OK, offset, out);
+        }
+    } // namespace utf8::nothrow
+} // namespace utf8
+
+#endif // header guard
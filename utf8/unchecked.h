@@ -35,13 +35,13 @@ namespace utf8
     namespace unchecked
     {
         template <typename octet_iterator>
-        octet_iterator append(utfchar32_t cp, octet_iterator result)
+        UTF_CPP_CONSTEXPR14 octet_iterator append(utfchar32_t cp, octet_iterator result)
         {
             return internal::append(cp, result);
         }
 
         template <typename word_iterator>
-        word_iterator append16(utfchar32_t cp, word_iterator result)
+        UTF_CPP_CONSTEXPR14 word_iterator append16(utfchar32_t cp, word_iterator result)
         {
             return internal::append16(cp, result);
         }
@@ -79,6 +79,32 @@ namespace utf8
             return out;
         }
 
+        // Contiguous input: clean spans are located with the word-at-a-time find_invalid
+        // and copied in bulk; invalid sequences are replaced exactly as above
+        template <typename octet_type, typename output_iterator>
+        output_iterator replace_invalid(octet_type* start, octet_type* end, output_iterator out, utfchar32_t replacement)
+        {
+            while (start != end) {
+                octet_type* invalid = utf8::find_invalid(start, end);
+                out = std::copy(start, invalid, out);
+                if (invalid == end)
+                    break;
+                start = invalid;
+                const internal::utf_error err_code = utf8::internal::validate_next(start, end);
+                out = utf8::unchecked::append(replacement, out);
+                if (err_code == internal::NOT_ENOUGH_ROOM)
+                    start = end;
+                else {
+                    ++start;
+                    // just one replacement mark for the sequence
+                    if (err_code != internal::INVALID_LEAD)
+                        while (start != end && utf8::internal::is_trail(*start))
+                            ++start;
+                }
+            }
+            return out;
+        }
+
         template <typename octet_iterator, typename output_iterator>
         inline output_iterator replace_invalid(octet_iterator start, octet_iterator end, output_iterator out)
         {
@@ -89,14 +115,14 @@ namespace utf8
         inline std::string replace_invalid(const std::string& s, utfchar32_t replacement)
         {
             std::string result;
-            replace_invalid(s.begin(), s.end(), std::back_inserter(result), replacement);
+            replace_invalid(s.data(), s.data() + s.size(), std::back_inserter(result), replacement);
             return result;
         }
 
         inline std::string replace_invalid(const std::string& s)
         {
             std::string result;
-            replace_invalid(s.begin(), s.end(), std::back_inserter(result));
+            replace_invalid(s.data(), s.data() + s.size(), std::back_inserter(result));
             return result;
         }
 
@@ -136,6 +162,19 @@ namespace utf8
             return utf8::unchecked::next(it);
         }
 
+        template <typename octet_iterator, typename u32_type>
+        std::size_t decode_block(octet_iterator& it, octet_iterator end, u32_type* out, std::size_t n)
+        {
+            std::size_t count = 0;
+            while (count < n && it != end) {
+                count += utf8::internal::decode_ascii(it, end, out + count, n - count);
+                if (count == n || it == end)
+                    break;
+                out[count++] = utf8::unchecked::next(it);
+            }
+            return count;
+        }
+
         template <typename word_iterator>
         utfchar32_t next16(word_iterator& it)
         {
@@ -168,6 +207,41 @@ namespace utf8
             }
         }
 
+        // Contiguous input: going backward, lead octets are counted a word at a time
+        template <typename octet_type, typename distance_type>
+        void advance(octet_type*& it, distance_type n)
+        {
+            const distance_type zero(0);
+            if (n < zero)
+                utf8::internal::retreat_lead_octets(it, static_cast<std::size_t>(zero - n));
+            else {
+                for (distance_type i = zero; i < n; ++i)
+                    utf8::unchecked::next(it);
+            }
+        }
+
+        // Decodes the n code points in front of it, last one first, and moves it back past them
+        template <typename octet_iterator, typename u32_type>
+        std::size_t decode_block_backward(octet_iterator& it, u32_type* out, std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                out[i] = utf8::unchecked::prior(it);
+            return n;
+        }
+
+        // Contiguous input: the lead octets are counted back a word at a time
+        // and the span is decoded forward in bulk
+        template <typename octet_type, typename u32_type>
+        std::size_t decode_block_backward(octet_type*& it, u32_type* out, std::size_t n)
+        {
+            octet_type* const end = it;
+            utf8::internal::retreat_lead_octets(it, n);
+            octet_type* temp = it;
+            utf8::unchecked::decode_block(temp, end, out, n);
+            std::reverse(out, out + n);
+            return n;
+        }
+
         template <typename octet_iterator>
         typename std::iterator_traits<octet_iterator>::difference_type
         distance(octet_iterator first, octet_iterator last)
@@ -178,6 +252,21 @@ namespace utf8
             return dist;
         }
 
+        // Contiguous input: the count is the number of octets that are not continuation octets
+        template <typename octet_type>
+        std::ptrdiff_t distance(octet_type* first, octet_type* last)
+        {
+            if (!(first < last))
+                return 0;
+            return static_cast<std::ptrdiff_t>(utf8::internal::count_lead_octets(first, last));
+        }
+
+        // NUL-terminated input: counted up to the terminator in a single pass, without strlen
+        inline std::ptrdiff_t distance(const char* str)
+        {
+            return static_cast<std::ptrdiff_t>(utf8::internal::count_lead_octets_cstr(str));
+        }
+
         template <typename u16bit_iterator, typename octet_iterator>
         octet_iterator utf16to8(u16bit_iterator start, u16bit_iterator end, octet_iterator result)
         {
@@ -210,6 +299,25 @@ namespace utf8
             return result;
         }
 
+        // Contiguous input: words of ASCII or of two-octet sequences are decoded a word at a time
+        template <typename u16bit_iterator, typename octet_type>
+        u16bit_iterator utf8to16(octet_type* start, octet_type* end, u16bit_iterator result)
+        {
+            while (start < end) {
+                result = utf8::internal::decode_word_runs<utfchar16_t>(start, end, result);
+                if (start == end)
+                    break;
+                const utfchar32_t cp = utf8::unchecked::next(start);
+                if (cp > 0xffff) { //make a surrogate pair
+                    *result++ = static_cast<utfchar16_t>((cp >> 10)   + internal::LEAD_OFFSET);
+                    *result++ = static_cast<utfchar16_t>((cp & 0x3ff) + internal::TRAIL_SURROGATE_MIN);
+                }
+                else
+                    *result++ = static_cast<utfchar16_t>(cp);
+            }
+            return result;
+        }
+
         template <typename octet_iterator, typename u32bit_iterator>
         octet_iterator utf32to8(u32bit_iterator start, u32bit_iterator end, octet_iterator result)
         {
@@ -228,6 +336,18 @@ namespace utf8
             return result;
         }
 
+        template <typename octet_type, typename u32bit_iterator>
+        u32bit_iterator utf8to32(octet_type* start, octet_type* end, u32bit_iterator result)
+        {
+            while (start < end) {
+                result = utf8::internal::decode_word_runs<utfchar32_t>(start, end, result);
+                if (start == end)
+                    break;
+                (*result++) = utf8::unchecked::next(start);
+            }
+            return result;
+        }
+
         // The iterator class
         template <typename octet_iterator>
           class iterator {